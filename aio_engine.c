@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <linux/aio_abi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "read_files.h"
+
+/*
+ * Linux native AIO engine, raw io_setup/io_submit/io_getevents syscalls so
+ * there is no libaio dependency. Same sliding window as the io_uring engine:
+ * `depth` iocbs, files admitted in order and split into chunks, short reads
+ * resubmitted. Only truly asynchronous for O_DIRECT; on buffered files
+ * io_submit blocks until the data is in the page cache.
+ */
+
+// io_submit can refuse with EAGAIN while nothing of ours is in flight (the
+// system-wide aio-max-nr is used up); back off this many times 1ms, then fail
+#define AIO_EAGAIN_RETRIES 1000
+
+static long sys_io_setup(unsigned nr, aio_context_t *ctx) {
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static long sys_io_destroy(aio_context_t ctx) {
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static long sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs) {
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static long sys_io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events) {
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+// one chunk read in flight, iocb.aio_data is its slot
+typedef struct AioOp {
+    int file;
+    off_t offset;       // file offset still to read
+    size_t len;         // bytes still to read
+    void *dest;         // where they go
+    int bounce;         // O_DIRECT tail, read through the slot's bounce buffer
+    unsigned long long start_ns; // first submit, kept across short-read resubmits
+} AioOp;
+
+typedef struct AioWindow {
+    unsigned depth;
+    AioOp *ops;
+    struct iocb *iocbs;
+    struct iocb **queue; // iocbs to submit this round
+    unsigned nqueue;
+    unsigned *free_ops;
+    unsigned nfree;
+    char *bounce;       // DIO_BOUNCE_SIZE per slot
+    int next;           // next file to admit
+    int next_opened;    // files[next] already has fd and buffer
+} AioWindow;
+
+static void queue_iocb(RIOVec files[], AioWindow *win, unsigned slot) {
+    AioOp *op = &win->ops[slot];
+    RIOVec *f = &files[op->file];
+    struct iocb *cb = &win->iocbs[slot];
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_lio_opcode = IOCB_CMD_PREAD;
+    cb->aio_fildes = f->fd;
+    cb->aio_offset = op->offset;
+    cb->aio_data = slot;
+    if (op->bounce) {
+        // a whole aligned block, the read comes back short at EOF
+        cb->aio_buf = (unsigned long)(win->bounce + (size_t)slot * DIO_BOUNCE_SIZE);
+        cb->aio_nbytes = f->dio_align;
+    } else {
+        cb->aio_buf = (unsigned long)op->dest;
+        cb->aio_nbytes = op->len;
+    }
+    win->queue[win->nqueue++] = cb;
+}
+
+static void finish_file(RIOVec files[], int index, const ReadOptions *opts) {
+    scatter_ranges(&files[index]);
+    printf("read %lu bytes from file %d\n", files[index].fOutBytes, index);
+    close(files[index].fd);
+    files[index].fd = -1;
+    // iocbs already submitted keep going while the consumer runs
+    deliver_file(&files[index], index, opts);
+}
+
+// open files and cut chunks until every iocb is in use; waits for files
+// still to be listed only when there is nothing else to do
+static int prep_iocbs(FileList *list, AioWindow *win, int idle, const ReadOptions *opts) {
+    RIOVec *files = list->files;
+    while (win->nfree && file_list_get(list, win->next, idle && !win->nqueue) == 1) {
+        int i = win->next;
+        RIOVec *f = &files[i];
+        if (!win->next_opened) {
+            if (!budget_room(idle && !win->nqueue)) {
+                break;
+            }
+            if (make_riovec(f->pathname, f, NULL, opts->direct)) {
+                fprintf(stderr, "initialization failed for file[%d] (%s)\n", i, f->pathname);
+                return 1;
+            }
+            win->next_opened = 1;
+            if (f->fSize == 0) {
+                finish_file(files, i, opts);
+                win->next++;
+                win->next_opened = 0;
+                continue;
+            }
+        }
+
+        unsigned slot = win->free_ops[--win->nfree];
+        AioOp *op = &win->ops[slot];
+        op->file = i;
+        op->len = next_piece(f, opts->chunk_size, &op->offset, &op->dest, &op->bounce);
+        op->start_ns = now_ns();
+        queue_iocb(files, win, slot);
+        f->inflight++;
+        if (f->queued == f->fSize) {
+            win->next++;
+            win->next_opened = 0;
+        }
+    }
+    return 0;
+}
+
+static void complete_iocb(RIOVec files[], AioWindow *win, unsigned slot, size_t res,
+                          const ReadOptions *opts) {
+    AioOp *op = &win->ops[slot];
+    RIOVec *f = &files[op->file];
+    if (op->bounce) {
+        if (res > op->len) {
+            res = op->len;
+        }
+        memcpy(op->dest, win->bounce + (size_t)slot * DIO_BOUNCE_SIZE, res);
+    }
+    f->fOutBytes += res;
+
+    if (res > 0 && res < op->len && !op->bounce) {
+        // short read, pick up where the kernel stopped
+        op->offset += res;
+        op->len -= res;
+        op->dest = (char *)op->dest + res;
+        queue_iocb(files, win, slot);
+        return;
+    }
+    if (res < op->len) {
+        fprintf(stderr, "file[%d] ended early at %lu of %lu bytes\n",
+            op->file, f->fOutBytes, f->fSize);
+    }
+    latency_record(&read_latency, f->fSize, now_ns() - op->start_ns);
+    win->free_ops[win->nfree++] = slot;
+    if (--f->inflight == 0 && f->queued == f->fSize) {
+        finish_file(files, op->file, opts);
+    }
+}
+
+static int aio_probe(const ReadOptions *opts, const char *sample) {
+    aio_context_t ctx = 0;
+    (void)opts;
+    (void)sample;
+    if (sys_io_setup(1, &ctx)) {
+        return 1;
+    }
+    sys_io_destroy(ctx);
+    return 0;
+}
+
+static int aio_run(FileList *list, const ReadOptions *opts) {
+    RIOVec *files = list->files;
+    aio_context_t ctx = 0;
+    if (sys_io_setup(opts->depth, &ctx)) {
+        // bounded system wide by fs.aio-max-nr
+        perror("io_setup");
+        return 1;
+    }
+
+    AioWindow win;
+    memset(&win, 0, sizeof(win));
+    win.depth = opts->depth;
+    win.ops = calloc(win.depth, sizeof(AioOp));
+    win.iocbs = calloc(win.depth, sizeof(struct iocb));
+    win.queue = calloc(win.depth, sizeof(struct iocb *));
+    win.free_ops = calloc(win.depth, sizeof(unsigned));
+    struct io_event *events = calloc(win.depth, sizeof(struct io_event));
+    if (!win.ops || !win.iocbs || !win.queue || !win.free_ops || !events) {
+        perror("calloc");
+        return 1;
+    }
+    if (opts->direct && posix_memalign((void **)&win.bounce, DIO_BOUNCE_SIZE, (size_t)win.depth * DIO_BOUNCE_SIZE)) {
+        perror("posix_memalign");
+        return 1;
+    }
+    for (unsigned i = 0; i < win.depth; i++) {
+        win.free_ops[i] = win.depth - 1 - i;
+    }
+    win.nfree = win.depth;
+
+    int submitted = 0;
+    unsigned outstanding = 0;
+    unsigned stalls = 0;
+    for (;;) {
+        if (prep_iocbs(list, &win, outstanding == 0, opts)) {
+            return 1;
+        }
+        // an idle prep only comes back empty once the list has ended
+        if (win.nqueue == 0 && outstanding == 0) {
+            break;
+        }
+
+        // io_submit may take only part of the batch
+        unsigned done = 0;
+        while (done < win.nqueue) {
+            long ret = sys_io_submit(ctx, win.nqueue - done, win.queue + done);
+            if (ret < 0 && errno == EAGAIN) {
+                break;
+            }
+            if (ret < 0) {
+                perror("io_submit");
+                return 1;
+            }
+            done += ret;
+        }
+        submitted += done;
+        memmove(win.queue, win.queue + done, (win.nqueue - done) * sizeof(struct iocb *));
+        win.nqueue -= done;
+        outstanding += done;
+        if (outstanding == 0) {
+            // no completion will free anything up, only time will
+            if (++stalls > AIO_EAGAIN_RETRIES) {
+                fprintf(stderr, "io_submit: %s\n", strerror(EAGAIN));
+                return 1;
+            }
+            nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+            continue;
+        }
+        stalls = 0;
+
+        long n = sys_io_getevents(ctx, 1, win.depth, events);
+        if (n < 0 && errno != EINTR) {
+            perror("io_getevents");
+            return 1;
+        }
+        if (n > 0) {
+            outstanding -= n;
+        }
+        for (long e = 0; e < n; e++) {
+            unsigned slot = (unsigned)events[e].data;
+            AioOp *op = &win.ops[slot];
+            if (events[e].res < 0) {
+                fprintf(stderr, "read file[%d] (%s) failed: %s\n",
+                    op->file, files[op->file].pathname, strerror(-events[e].res));
+                return 1;
+            }
+            complete_iocb(files, &win, slot, (size_t)events[e].res, opts);
+        }
+    }
+    printf("submitted %d iocbs\n", submitted);
+
+    sys_io_destroy(ctx);
+    free(win.ops);
+    free(win.iocbs);
+    free(win.queue);
+    free(win.free_ops);
+    free(win.bounce);
+    free(events);
+    return 0;
+}
+
+static void aio_release(void) {
+}
+
+const ReadEngine aio_engine = {
+    .name = "aio",
+    .probe = aio_probe,
+    .run = aio_run,
+    .release = aio_release,
+};
@@ -0,0 +1,434 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "read_files.h"
+
+/*
+ * Benchmark the read engines on generated datasets
+ *
+ * make bench
+ *
+ * -- Steps --
+ * 1. Generate (or reuse) one directory of files per size distribution
+ * 2. For every dataset, strategy and cache state, read the whole dataset
+ *    `runs` times through the engine in-process
+ * 3. Write one JSON record per combination
+ *
+ * Datasets are derived from a fixed seed, so every host benchmarks the same
+ * file sizes; files already on disk with the right size are reused. A cold
+ * run drops each file from the page cache with POSIX_FADV_DONTNEED first, a
+ * warm run follows one untimed read of the dataset.
+ *
+ * IOPS counts chunk-sized reads (the unit every engine issues), CPU time is
+ * user and system time of the whole process including io_uring workers.
+ * run_ms percentiles are over the wall time of the repeated runs, read_us
+ * over every single read of the timed runs.
+ *
+ */
+
+#define DEFAULT_DATASET_SIZE (256UL << 20)
+#define DEFAULT_RUNS 5
+#define BENCH_SEED 0x5eed
+
+typedef struct Dataset {
+    const char *name;
+    char **paths;
+    size_t *sizes;
+    int num_files;
+    size_t total;
+} Dataset;
+
+typedef struct Strategy {
+    const char *name;
+    const ReadEngine *engine;
+    unsigned depth;     // 0 keeps the -d depth
+    unsigned workers;   // rings for the uring engine, 0 for one per cpu
+} Strategy;
+
+static unsigned long long rng_state = BENCH_SEED;
+
+// xorshift64*, so datasets do not depend on the libc rand()
+static unsigned long long rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double rng_unit(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t uniform_size(size_t lo, size_t hi) {
+    return lo + rng_next() % (hi - lo + 1);
+}
+
+// Pareto with alpha 1.2 from 4K, capped at 64M: mostly small, a few large
+static size_t pareto_size(void) {
+    double size = 4096.0 * pow(1.0 - rng_unit(), -1.0 / 1.2);
+    return size > (64UL << 20) ? (64UL << 20) : (size_t)size;
+}
+
+static int add_file(Dataset *ds, size_t size) {
+    if ((ds->num_files & (ds->num_files - 1)) == 0) {
+        int cap = ds->num_files ? ds->num_files * 2 : 64;
+        ds->sizes = realloc(ds->sizes, cap * sizeof(size_t));
+        ds->paths = realloc(ds->paths, cap * sizeof(char *));
+        if (!ds->sizes || !ds->paths) {
+            perror("realloc");
+            return 1;
+        }
+    }
+    ds->sizes[ds->num_files++] = size;
+    ds->total += size;
+    return 0;
+}
+
+static int plan_dataset(Dataset *ds, size_t total) {
+    rng_state = BENCH_SEED;
+    if (strcmp(ds->name, "uniform") == 0) {
+        while (ds->total < total) {
+            if (add_file(ds, uniform_size(4096, 1UL << 20))) {
+                return 1;
+            }
+        }
+    } else if (strcmp(ds->name, "pareto") == 0) {
+        while (ds->total < total) {
+            if (add_file(ds, pareto_size())) {
+                return 1;
+            }
+        }
+    } else if (strcmp(ds->name, "many-tiny") == 0) {
+        // the data volume does not matter here, the file count does
+        for (int i = 0; i < 8192; i++) {
+            if (add_file(ds, uniform_size(1, 4096))) {
+                return 1;
+            }
+        }
+    } else if (strcmp(ds->name, "few-huge") == 0) {
+        for (int i = 0; i < 4; i++) {
+            if (add_file(ds, total / 4)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int write_file(const char *path, size_t size, const char *fill, size_t fill_size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    size_t done = 0;
+    while (done < size) {
+        size_t off = done % fill_size;
+        size_t len = size - done < fill_size - off ? size - done : fill_size - off;
+        ssize_t n = write(fd, fill + off, len);
+        if (n < 0) {
+            perror(path);
+            close(fd);
+            return 1;
+        }
+        done += n;
+    }
+    // dirty pages cannot be dropped for the cold runs
+    if (fsync(fd)) {
+        perror(path);
+    }
+    close(fd);
+    return 0;
+}
+
+static int make_dataset(Dataset *ds, const char *dir, size_t total) {
+    if (plan_dataset(ds, total)) {
+        return 1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, ds->name);
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        perror(path);
+        return 1;
+    }
+
+    size_t fill_size = 1UL << 20;
+    char *fill = malloc(fill_size);
+    if (!fill) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < fill_size; i += sizeof(unsigned long long)) {
+        unsigned long long v = rng_next();
+        memcpy(fill + i, &v, sizeof(v));
+    }
+
+    int written = 0;
+    for (int i = 0; i < ds->num_files; i++) {
+        snprintf(path, sizeof(path), "%s/%s/%06d", dir, ds->name, i);
+        ds->paths[i] = strdup(path);
+        struct stat st;
+        if (stat(path, &st) == 0 && (size_t)st.st_size == ds->sizes[i]) {
+            continue;
+        }
+        if (write_file(path, ds->sizes[i], fill, fill_size)) {
+            free(fill);
+            return 1;
+        }
+        written++;
+    }
+    free(fill);
+    fprintf(stderr, "%s: %d files, %zu bytes (%d written)\n", ds->name, ds->num_files, ds->total, written);
+    return 0;
+}
+
+static void free_dataset(Dataset *ds) {
+    for (int i = 0; i < ds->num_files; i++) {
+        free(ds->paths[i]);
+    }
+    free(ds->paths);
+    free(ds->sizes);
+}
+
+static void drop_cache(const Dataset *ds) {
+    for (int i = 0; i < ds->num_files; i++) {
+        int fd = open(ds->paths[i], O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+static double cpu_time(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec * 1e-6;
+}
+
+// one pass over the dataset with the engines' per-file output silenced
+static int run_once(const Dataset *ds, const Strategy *s, const ReadOptions *opts) {
+    RIOVec *files = calloc(ds->num_files, sizeof(RIOVec));
+    if (!files) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < ds->num_files; i++) {
+        files[i].pathname = ds->paths[i];
+        files[i].fd = -1;
+        files[i].buf_index = -1;
+    }
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    FileList list;
+    file_list_init(&list, files, ds->num_files);
+    int ret = s->engine->run(&list, opts);
+    for (int i = 0; i < ds->num_files; i++) {
+        free_riovec(&files[i]);
+    }
+    release_slabs();
+    file_list_free(&list);
+    free(files);
+    if (ret == 0) {
+        s->engine->release();
+    }
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return ret;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static int bench(FILE *out, const Dataset *ds, const Strategy *s, int cold,
+        const ReadOptions *base, int runs, int *first) {
+    ReadOptions opts = *base;
+    if (s->depth) {
+        opts.depth = s->depth;
+    }
+    opts.workers = s->workers ? s->workers : (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+    if (s->engine->probe(&opts, ds->num_files ? ds->paths[0] : NULL)) {
+        fprintf(stderr, "%s engine not usable here, skipping %s\n", s->engine->name, s->name);
+        return 0;
+    }
+    if (!cold && run_once(ds, s, &opts)) {
+        return 1;
+    }
+
+    double *wall = calloc(runs, sizeof(double));
+    if (!wall) {
+        perror("calloc");
+        return 1;
+    }
+    double user = 0, sys = 0;
+    latency_reset(&read_latency);
+    for (int r = 0; r < runs; r++) {
+        if (cold) {
+            drop_cache(ds);
+        }
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        double start = now_ns() * 1e-9;
+        if (run_once(ds, s, &opts)) {
+            free(wall);
+            return 1;
+        }
+        wall[r] = now_ns() * 1e-9 - start;
+        getrusage(RUSAGE_SELF, &after);
+        user += cpu_time(&after.ru_utime) - cpu_time(&before.ru_utime);
+        sys += cpu_time(&after.ru_stime) - cpu_time(&before.ru_stime);
+    }
+
+    double total = 0;
+    for (int r = 0; r < runs; r++) {
+        total += wall[r];
+    }
+    unsigned long reads = 0;
+    for (int i = 0; i < ds->num_files; i++) {
+        reads += (ds->sizes[i] + opts.chunk_size - 1) / opts.chunk_size;
+    }
+    qsort(wall, runs, sizeof(double), cmp_double);
+
+    fprintf(out, "%s  {\"dataset\": \"%s\", \"files\": %d, \"bytes\": %zu, "
+        "\"strategy\": \"%s\", \"engine\": \"%s\", \"depth\": %u, \"workers\": %u, \"chunk_size\": %zu, "
+        "\"cache\": \"%s\", \"runs\": %d, "
+        "\"throughput_mib_s\": %.1f, \"iops\": %.0f, "
+        "\"cpu_user_s\": %.4f, \"cpu_sys_s\": %.4f, "
+        "\"run_ms\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}, "
+        "\"read_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}}",
+        *first ? "" : ",\n", ds->name, ds->num_files, ds->total,
+        s->name, s->engine->name, opts.depth, opts.workers, opts.chunk_size,
+        cold ? "cold" : "warm", runs,
+        ds->total * runs / total / (1 << 20), reads * runs / total,
+        user / runs, sys / runs,
+        wall[0] * 1e3, percentile(wall, runs, 0.5) * 1e3, percentile(wall, runs, 0.9) * 1e3,
+        percentile(wall, runs, 0.99) * 1e3, wall[runs - 1] * 1e3,
+        latency_percentile(&read_latency, -1, 0.5) / 1e3, latency_percentile(&read_latency, -1, 0.99) / 1e3,
+        latency_percentile(&read_latency, -1, 0.999) / 1e3, latency_percentile(&read_latency, -1, 1.0) / 1e3);
+    fflush(out);
+    *first = 0;
+    free(wall);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("%s: [-D dir] [-s dataset_size] [-r runs] [-d depth] [-c chunk_size] [-o out.json]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+
+    const char *dir = "bench-data";
+    const char *out_path = NULL;
+    size_t dataset_size = DEFAULT_DATASET_SIZE;
+    unsigned runs = DEFAULT_RUNS;
+    ReadOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.depth = DEFAULT_QUEUE_DEPTH;
+    opts.chunk_size = DEFAULT_CHUNK_SIZE;
+    opts.batch = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "D:s:r:d:c:o:")) != -1) {
+        switch (opt) {
+        case 'D':
+            dir = optarg;
+            break;
+        case 's':
+            if (parse_size(optarg, &dataset_size) || dataset_size == 0) {
+                fprintf(stderr, "bad dataset size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            if (parse_uint(optarg, 100000, &runs) || runs == 0) {
+                fprintf(stderr, "bad run count: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            if (parse_uint(optarg, 32768, &opts.depth) || opts.depth == 0) {
+                fprintf(stderr, "bad queue depth: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (parse_size(optarg, &opts.chunk_size) || opts.chunk_size == 0 || opts.chunk_size > MAX_CHUNK_SIZE) {
+                fprintf(stderr, "bad chunk size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *out = stdout;
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        perror(out_path);
+        return 1;
+    }
+
+    Dataset datasets[] = {
+        {.name = "uniform"}, {.name = "pareto"}, {.name = "many-tiny"}, {.name = "few-huge"},
+    };
+    // a single pread thread is the synchronous baseline
+    Strategy strategies[] = {
+        {"io_uring", &uring_engine, 0, 1},
+        {"io_uring-sharded", &uring_engine, 0, 0},
+        {"pread", &pread_engine, 1, 1},
+        {"threaded-pread", &pread_engine, 0, 1},
+        {"mmap", &mmap_engine, 0, 1},
+    };
+    int num_datasets = sizeof(datasets) / sizeof(datasets[0]);
+    int num_strategies = sizeof(strategies) / sizeof(strategies[0]);
+
+    int first = 1;
+    fprintf(out, "[\n");
+    for (int d = 0; d < num_datasets; d++) {
+        if (make_dataset(&datasets[d], dir, dataset_size)) {
+            return 1;
+        }
+        for (int s = 0; s < num_strategies; s++) {
+            for (int cold = 1; cold >= 0; cold--) {
+                if (bench(out, &datasets[d], &strategies[s], cold, &opts, runs, &first)) {
+                    fprintf(stderr, "%s on %s failed\n", strategies[s].name, datasets[d].name);
+                    return 1;
+                }
+            }
+        }
+        free_dataset(&datasets[d]);
+    }
+    fprintf(out, "\n]\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
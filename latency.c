@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "read_files.h"
+
+/*
+ * Log-linear read latency histogram, HDR style: values below 2 * LAT_SUB are
+ * counted exactly, above that every power of two is split into LAT_SUB
+ * linear buckets, so any percentile is within 1/LAT_SUB of the true value.
+ * Recording is a clz, a shift and an increment.
+ */
+
+LatencyHist read_latency;
+
+static const char *size_names[LAT_SIZE_BUCKETS] = { "<4K", "<64K", "<1M", "<16M", ">=16M" };
+
+unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int size_bucket(size_t size) {
+    int b = 0;
+    for (size_t limit = 4096; b < LAT_SIZE_BUCKETS - 1 && size >= limit; limit <<= 4) {
+        b++;
+    }
+    return b;
+}
+
+static unsigned value_bucket(unsigned long long ns) {
+    if (ns >= LAT_MAX_NS) {
+        ns = LAT_MAX_NS - 1;
+    }
+    int msb = 63 - __builtin_clzll(ns | 1);
+    int shift = msb > LAT_SUB_BITS ? msb - LAT_SUB_BITS : 0;
+    return shift * LAT_SUB + (unsigned)(ns >> shift);
+}
+
+// the value frac of the way into the values a bucket covers
+static unsigned long long bucket_value(unsigned idx, double frac) {
+    if (idx < 2 * LAT_SUB) {
+        return idx;
+    }
+    unsigned shift = idx / LAT_SUB - 1;
+    unsigned long long lo = (unsigned long long)(idx % LAT_SUB + LAT_SUB) << shift;
+    return lo + (unsigned long long)(frac * (1ULL << shift));
+}
+
+void latency_record(LatencyHist *h, size_t file_size, unsigned long long ns) {
+    int b = size_bucket(file_size);
+    h->counts[b][value_bucket(ns)]++;
+    h->reads[b]++;
+    if (ns > h->max[b]) {
+        h->max[b] = ns;
+    }
+}
+
+void latency_merge(LatencyHist *dst, const LatencyHist *src) {
+    for (int b = 0; b < LAT_SIZE_BUCKETS; b++) {
+        for (int i = 0; i < LAT_BUCKETS; i++) {
+            dst->counts[b][i] += src->counts[b][i];
+        }
+        dst->reads[b] += src->reads[b];
+        if (src->max[b] > dst->max[b]) {
+            dst->max[b] = src->max[b];
+        }
+    }
+}
+
+void latency_reset(LatencyHist *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+// p in [0, 1] over one size bucket, or over all of them with bucket -1
+unsigned long long latency_percentile(const LatencyHist *h, int bucket, double p) {
+    int lo = bucket < 0 ? 0 : bucket;
+    int hi = bucket < 0 ? LAT_SIZE_BUCKETS - 1 : bucket;
+    unsigned long long total = 0, max = 0;
+    for (int b = lo; b <= hi; b++) {
+        total += h->reads[b];
+        if (h->max[b] > max) {
+            max = h->max[b];
+        }
+    }
+    if (total == 0) {
+        return 0;
+    }
+    if (p >= 1.0) {
+        return max;
+    }
+    // nearest rank: the smallest value with at least p of the reads at or
+    // below it; the slack keeps 0.99 * 100 from rounding up past 99
+    double want = p * total - 1e-6;
+    unsigned long long rank = (unsigned long long)want, seen = 0;
+    if (rank < want || rank == 0) {
+        rank++;
+    }
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        unsigned long long in = 0;
+        for (int b = lo; b <= hi; b++) {
+            in += h->counts[b][i];
+        }
+        if (seen + in >= rank) {
+            // the reads in a bucket are taken as spread evenly over it, so
+            // neighbouring ranks in one bucket do not all read as its middle
+            unsigned long long v = bucket_value(i, (rank - seen - 0.5) / in);
+            return v < max ? v : max;
+        }
+        seen += in;
+    }
+    return max;
+}
+
+void latency_report(const LatencyHist *h, FILE *out) {
+    fprintf(out, "read latency (us)  %10s %10s %10s %10s %10s\n", "reads", "p50", "p99", "p99.9", "max");
+    for (int b = -1; b < LAT_SIZE_BUCKETS; b++) {
+        unsigned long long reads = 0;
+        for (int s = 0; s < LAT_SIZE_BUCKETS; s++) {
+            if (b < 0 || s == b) {
+                reads += h->reads[s];
+            }
+        }
+        if (reads == 0) {
+            continue;
+        }
+        fprintf(out, "  %-16s %10llu %10.1f %10.1f %10.1f %10.1f\n",
+            b < 0 ? "all files" : size_names[b], reads,
+            latency_percentile(h, b, 0.5) / 1e3, latency_percentile(h, b, 0.99) / 1e3,
+            latency_percentile(h, b, 0.999) / 1e3, latency_percentile(h, b, 1.0) / 1e3);
+    }
+}
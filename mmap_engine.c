@@ -0,0 +1,145 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "read_files.h"
+
+/*
+ * mmap engine: map each file read-only and fault it in up front with
+ * MADV_POPULATE_READ (5.14+), falling back to touching every page. fBuffer
+ * points into the mapping, which free_riovec unmaps.
+ *
+ * Page cache only, so it is never used for O_DIRECT. Files read by ranges
+ * are mapped just long enough to copy the ranges out.
+ */
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+// each chunk populated counts as one read
+static int populate(char *addr, size_t len, size_t chunk_size) {
+    static int have_populate = 1;
+    for (size_t off = 0; off < len; off += chunk_size) {
+        size_t n = len - off < chunk_size ? len - off : chunk_size;
+        unsigned long long start = now_ns();
+        if (have_populate) {
+            if (!madvise(addr + off, n, MADV_POPULATE_READ)) {
+                latency_record(&read_latency, len, now_ns() - start);
+                continue;
+            }
+            if (errno != EINVAL) {
+                return 1;
+            }
+            // older kernel, fault pages in by hand from here on
+            have_populate = 0;
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        volatile char sink = 0;
+        for (size_t p = 0; p < n; p += page) {
+            sink += addr[off + p];
+        }
+        (void)sink;
+        latency_record(&read_latency, len, now_ns() - start);
+    }
+    return 0;
+}
+
+// the planned reads are copied out of a temporary mapping
+static int read_ranges(RIOVec *f, int index, size_t file_size, size_t chunk_size) {
+    if (alloc_riovec(f, file_size, NULL, -1)) {
+        return 1;
+    }
+    if (file_size == 0) {
+        return 0;
+    }
+    char *addr = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    if (addr == MAP_FAILED) {
+        return 1;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (unsigned r = 0; r < f->nreads; r++) {
+        RIORange *range = &f->reads[r];
+        size_t off = (size_t)range->offset < file_size ? (size_t)range->offset : file_size;
+        size_t n = file_size - off < range->size ? file_size - off : range->size;
+        // madvise needs a page aligned start
+        size_t start = off & ~(page - 1);
+        if (n && populate(addr + start, off + n - start, chunk_size)) {
+            munmap(addr, file_size);
+            return 1;
+        }
+        memcpy(range->dest, addr + off, n);
+        f->fOutBytes += n;
+    }
+    munmap(addr, file_size);
+    if (f->fOutBytes < f->fSize) {
+        fprintf(stderr, "file[%d] ended early at %lu of %lu bytes\n", index, f->fOutBytes, f->fSize);
+    }
+    scatter_ranges(f);
+    return 0;
+}
+
+static int mmap_probe(const ReadOptions *opts, const char *sample) {
+    (void)sample;
+    return opts->direct;
+}
+
+static int mmap_run(FileList *list, const ReadOptions *opts) {
+    RIOVec *files = list->files;
+    for (int i = 0; file_list_get(list, i, 1) == 1; i++) {
+        RIOVec *f = &files[i];
+        f->fd = open(f->pathname, O_RDONLY);
+        if (f->fd < 0) {
+            perror("open");
+            fprintf(stderr, "initialization failed for file[%d] (%s)\n", i, f->pathname);
+            return 1;
+        }
+        struct stat st;
+        if (fstat(f->fd, &st)) {
+            perror("fstat");
+            return 1;
+        }
+        if (f->nranges) {
+            if (read_ranges(f, i, st.st_size, opts->chunk_size)) {
+                fprintf(stderr, "read file[%d] (%s) failed: %s\n", i, f->pathname, strerror(errno));
+                return 1;
+            }
+        } else if (st.st_size) {
+            void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+            if (addr == MAP_FAILED) {
+                fprintf(stderr, "mmap file[%d] (%s) failed: %s\n", i, f->pathname, strerror(errno));
+                return 1;
+            }
+            f->fBuffer = addr;
+            f->fOffset = 0;
+            f->fSize = st.st_size;
+            f->mapped = 1;
+            if (populate(addr, f->fSize, opts->chunk_size)) {
+                fprintf(stderr, "read file[%d] (%s) failed: %s\n", i, f->pathname, strerror(errno));
+                return 1;
+            }
+            f->fOutBytes = f->fSize;
+        }
+        // the mapping keeps the file alive
+        close(f->fd);
+        f->fd = -1;
+        printf("read %lu bytes from file %d\n", f->fOutBytes, i);
+        deliver_file(f, i, opts);
+    }
+    return 0;
+}
+
+static void mmap_release(void) {
+}
+
+const ReadEngine mmap_engine = {
+    .name = "mmap",
+    .probe = mmap_probe,
+    .run = mmap_run,
+    .release = mmap_release,
+};
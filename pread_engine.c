@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "read_files.h"
+
+/*
+ * Thread pool engine: up to `depth` threads hand out chunks under one lock
+ * and read them with pread(2). Needs nothing from the kernel beyond plain
+ * syscalls, so it is the fallback when io_uring is disabled.
+ *
+ * Files are admitted in order and opened by the thread that admits them,
+ * outside the lock. A thread that finds nothing to do while more files are
+ * still being listed waits for them outside the lock as well. Large files
+ * are split into chunks like in the io_uring engine so several threads can
+ * work on one file.
+ */
+
+#define MAX_POOL_THREADS 256
+
+typedef struct PreadPool {
+    pthread_mutex_t lock;
+    FileList *list;
+    RIOVec *files;
+    const ReadOptions *opts;
+    int next;           // next file to admit
+    int ready_head;     // files with chunks left to hand out, linked by next_ready
+    int ready_tail;
+    int failed;
+} PreadPool;
+
+static void push_ready(PreadPool *pool, int index) {
+    pool->files[index].next_ready = -1;
+    if (pool->ready_tail >= 0) {
+        pool->files[pool->ready_tail].next_ready = index;
+    } else {
+        pool->ready_head = index;
+    }
+    pool->ready_tail = index;
+}
+
+static void pop_ready(PreadPool *pool) {
+    pool->ready_head = pool->files[pool->ready_head].next_ready;
+    if (pool->ready_head < 0) {
+        pool->ready_tail = -1;
+    }
+}
+
+// called with the lock held, drops it while the consumer has the file
+static void finish_file(PreadPool *pool, int index) {
+    RIOVec *f = &pool->files[index];
+    scatter_ranges(f);
+    printf("read %lu bytes from file %d\n", f->fOutBytes, index);
+    close(f->fd);
+    f->fd = -1;
+    pthread_mutex_unlock(&pool->lock);
+    deliver_file(f, index, pool->opts);
+    pthread_mutex_lock(&pool->lock);
+}
+
+// read [off, off + len) of a file into buf, returns bytes read or -1
+static ssize_t read_range(RIOVec *f, off_t off, char *buf, size_t len) {
+    size_t done = 0;
+    // O_DIRECT tail is bounced below
+    size_t direct_len = f->dio_align ? len - len % f->dio_align : len;
+    while (done < direct_len) {
+        ssize_t n = pread(f->fd, buf + done, direct_len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return done;
+        }
+        done += n;
+    }
+    if (done < len) {
+        // a whole aligned block, the read comes back short at EOF
+        static _Thread_local char bounce[DIO_BOUNCE_SIZE] __attribute__((aligned(DIO_BOUNCE_SIZE)));
+        ssize_t n = pread(f->fd, bounce, f->dio_align, off + done);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n > len - done) {
+            n = len - done;
+        }
+        memcpy(buf + done, bounce, n);
+        done += n;
+    }
+    return done;
+}
+
+static void *pread_worker(void *arg) {
+    PreadPool *pool = arg;
+    const ReadOptions *opts = pool->opts;
+    // merged into read_latency when the thread exits
+    LatencyHist lat;
+    latency_reset(&lat);
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->failed) {
+        int i = pool->ready_head;
+        if (i < 0) {
+            int next = pool->next;
+            int more = file_list_get(pool->list, next, 0);
+            if (more < 0) {
+                // wait for the file to be listed without holding up readers
+                pthread_mutex_unlock(&pool->lock);
+                more = file_list_get(pool->list, next, 1);
+                pthread_mutex_lock(&pool->lock);
+                if (more) {
+                    continue;
+                }
+            }
+            if (!more) {
+                break;
+            }
+            if (!budget_room(0)) {
+                // reads in flight hand their buffers back, wait for that
+                // outside the lock too
+                pthread_mutex_unlock(&pool->lock);
+                budget_room(1);
+                pthread_mutex_lock(&pool->lock);
+                continue;
+            }
+            i = pool->next++;
+            RIOVec *f = &pool->files[i];
+            pthread_mutex_unlock(&pool->lock);
+            int err = make_riovec(f->pathname, f, NULL, opts->direct);
+            pthread_mutex_lock(&pool->lock);
+            if (err) {
+                fprintf(stderr, "initialization failed for file[%d] (%s)\n", i, f->pathname);
+                pool->failed = 1;
+                break;
+            }
+            if (f->fSize == 0) {
+                finish_file(pool, i);
+            } else {
+                push_ready(pool, i);
+            }
+            continue;
+        }
+
+        RIOVec *f = &pool->files[i];
+        off_t off;
+        void *dest;
+        int bounce;
+        // read_range bounces the unaligned tail itself
+        size_t len = next_piece(f, opts->chunk_size, &off, &dest, &bounce);
+        f->inflight++;
+        if (f->queued == f->fSize) {
+            pop_ready(pool);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        unsigned long long start = now_ns();
+        ssize_t got = read_range(f, off, dest, len);
+        latency_record(&lat, f->fSize, now_ns() - start);
+
+        pthread_mutex_lock(&pool->lock);
+        if (got < 0) {
+            fprintf(stderr, "read file[%d] (%s) failed: %s\n", i, f->pathname, strerror(errno));
+            pool->failed = 1;
+            break;
+        }
+        f->fOutBytes += got;
+        if ((size_t)got < len) {
+            fprintf(stderr, "file[%d] ended early at %lu of %lu bytes\n", i, f->fOutBytes, f->fSize);
+        }
+        if (--f->inflight == 0 && f->queued == f->fSize) {
+            finish_file(pool, i);
+        }
+    }
+    latency_merge(&read_latency, &lat);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int pread_probe(const ReadOptions *opts, const char *sample) {
+    (void)opts;
+    (void)sample;
+    return 0;
+}
+
+static int pread_run(FileList *list, const ReadOptions *opts) {
+    PreadPool pool = {
+        .list = list,
+        .files = list->files,
+        .opts = opts,
+        .ready_head = -1,
+        .ready_tail = -1,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+
+    unsigned nthreads = opts->depth < MAX_POOL_THREADS ? opts->depth : MAX_POOL_THREADS;
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (!threads) {
+        perror("calloc");
+        return 1;
+    }
+    unsigned started = 0;
+    for (; started < nthreads; started++) {
+        int err = pthread_create(&threads[started], NULL, pread_worker, &pool);
+        if (err) {
+            // run with the threads we have
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+    if (started == 0) {
+        free(threads);
+        return 1;
+    }
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+    printf("read with %u threads\n", started);
+    return pool.failed;
+}
+
+static void pread_release(void) {
+}
+
+const ReadEngine pread_engine = {
+    .name = "pread",
+    .probe = pread_probe,
+    .run = pread_run,
+    .release = pread_release,
+};
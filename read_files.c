@@ -1,187 +1,504 @@
-#include <fcntl.h>
+#define _GNU_SOURCE // CPU_SETSIZE
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <strings.h>
+#include <unistd.h>
 
-#include "liburing.h"
-#include "liburing/io_uring.h"
+#include "read_files.h"
 
 /*
- * Read a number of files in parallel using io_uring
+ * Read a number of files in parallel
  *
- * gcc -Wall -O2 -o read_files read_files.c -luring
+ * make
  *
- * -- Steps --
- * 1. Create the ring
- * 2. Check whether non-vectored read is supported using io_uring_probe
- * 3. If so, submit read(v) operations
- * 4. Reap read-completed completion queue entries
- * 5. Tear-down
+ * The read path sits behind a ReadEngine (read_files.h): io_uring
+ * (uring_engine.c), Linux native AIO (aio_engine.c), a pread thread pool
+ * (pread_engine.c) and mmap with page population (mmap_engine.c). -e picks
+ * one; by default each is probed in turn and the first usable one runs, so
+ * kernels or sandboxes without io_uring still get a parallel read.
+ *
+ * With -R, a file can be given as path@offset:size,offset:size,... to read
+ * only those ranges (ROOT baskets) instead of the whole file. The ranges are
+ * read in parallel like chunks and land back to back in fBuffer; the file is
+ * reported once every range is in. Ranges that touch or overlap are read
+ * once, -g also merges ranges up to that many bytes apart, trading bytes
+ * read for fewer ops.
+ *
+ * With -i, paths come from a manifest file (or stdin for -) instead of the
+ * command line, one per line, or NUL-terminated with -0 as written by
+ * find -print0. A reader thread lists each path as soon as it is read and
+ * the engine picks it up while running, so reading starts with the first
+ * files and lists of millions of paths never run into ARG_MAX.
+ *
+ * -P backs buffers of 2M and up (and the -F arena) with huge pages: thp for
+ * transparent huge pages, 2m or 1g for hugetlb pages of that size, falling
+ * back to thp when the pool is empty. Either way the buffer is prefaulted
+ * before the read.
+ *
+ * -n places each buffer on the NUMA node of the device its file lives on
+ * (from sysfs), and with the uring engine runs at least one worker on every
+ * node (more with -w), each reading the files of its node's devices.
+ *
+ * -M bounds the buffer memory: a file is only admitted while the buffers
+ * held add up to less than that many bytes, and each file is released as
+ * soon as it has been read and reported, so any amount of data streams
+ * through a fixed footprint (plus the files admitted at the same moment).
+ *
+ * -k checksums each file (FNV-1a) the moment it is complete, through the
+ * ReadOptions.on_ready hook, while the engine keeps reading the rest. The
+ * checksum is printed and the buffer released right away.
  *
  */
 
-typedef struct RIOVec {
-    const char *pathname;
-    int fd;
-    // fields in ROOT data structure
-    void *fBuffer;
-    off_t fOffset;
-    size_t fSize;
-    size_t fOutBytes;
-} RIOVec;
-
-// caller responsible for freeing RIOVec->fBuffer
-static int make_riovec(const char *pathname, RIOVec *rd) {
-    rd->pathname = pathname;
-    rd->fd = open(pathname, O_RDONLY);
-    if (rd->fd < 0) {
-        perror("open");
-        return 1;
-    }
-    struct stat st;
-    if (fstat(rd->fd, &st)) {
-        perror("fstat");
-        return 1;
-    }
-    rd->fBuffer = malloc(st.st_size);
-    if (!rd->fBuffer) {
-        perror("malloc");
-        return 1;
+// bounded[:unbounded] io-wq worker caps, 0 leaves a cap unchanged
+static int parse_iowq_max(char *arg, unsigned vals[2]) {
+    char *colon = strchr(arg, ':');
+    vals[1] = 0;
+    if (colon) {
+        *colon = '\0';
+        if (parse_uint(colon + 1, UINT_MAX, &vals[1])) {
+            return 1;
+        }
     }
-    rd->fOffset = 0; // read whole file
-    rd->fSize = st.st_size;
-    rd->fOutBytes = 0; // set by cqe
-    return 0;
+    return parse_uint(arg, UINT_MAX, &vals[0]) || (vals[0] == 0 && vals[1] == 0);
 }
 
-void free_riovec(RIOVec *io) {
-    if (NULL != io->fBuffer) {
-        free(io->fBuffer);
+static int parse_huge(const char *arg, int *out) {
+    const char *names[] = { "thp", "2m", "1g" };
+    for (int i = 0; i < 3; i++) {
+        if (strcasecmp(arg, names[i]) == 0) {
+            *out = HUGE_THP + i;
+            return 0;
+        }
     }
+    return 1;
 }
 
-// io_uring demo
-
-static int prep_reads(struct io_uring *ring, RIOVec files[], int num_files) {
-    struct io_uring_sqe *sqe;
-    for (int i = 0; i < num_files; i++) {
-        sqe = io_uring_get_sqe(ring);
-        if (!sqe) {
-            fprintf(stderr, "sqe get failed\n");
+// with -R, a file argument may be path@offset:size[,offset:size...]
+static int parse_ranges(RIOVec *rd, char *arg) {
+    char *at = strrchr(arg, '@');
+    if (!at) {
+        return 0;
+    }
+    *at = '\0';
+    unsigned n = 1;
+    for (char *c = at + 1; *c; c++) {
+        n += *c == ',';
+    }
+    rd->ranges = calloc(n, sizeof(RIORange));
+    if (!rd->ranges) {
+        perror("calloc");
+        return 1;
+    }
+    rd->nranges = n;
+    char *save;
+    unsigned i = 0;
+    for (char *tok = strtok_r(at + 1, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(tok, ':');
+        size_t offset;
+        if (!colon || i == n) {
             return 1;
         }
-
-        io_uring_prep_read(sqe,
-            files[i].fd,
-            files[i].fBuffer,
-            files[i].fSize,
-            files[i].fOffset
-        );
-
-        // mark position in files array
-        sqe->user_data = i;
+        *colon = '\0';
+        if (parse_size(tok, &offset) || parse_size(colon + 1, &rd->ranges[i].size)) {
+            return 1;
+        }
+        rd->ranges[i++].offset = offset;
     }
-    return 0;
+    return i != n;
 }
 
-static int reap_reads(struct io_uring *ring, RIOVec files[], int num_files) {
-    struct io_uring_cqe *cqe;
-    int ret;
-
-    for (int i = 0; i < num_files; i++) {
-        // if right number of sqes are submitted, won't hang but may return failure cqe
-        // if too few sqes are submitted, could wait forever
-        // -- maybe we switch to timeout
-        ret = io_uring_wait_cqe(ring, &cqe);
-        if (ret) {
-            fprintf(stderr, "wait cqe: %d\n", ret);
-            return 1;
+// paths for -i, read by their own thread while the engine runs
+typedef struct Manifest {
+    FILE *in;
+    const char *name;
+    int delim;          // '\n', or '\0' with -0
+    int ranges;
+    size_t merge_gap;
+    FileList *list;
+    int failed;
+} Manifest;
+
+static void *read_manifest(void *arg) {
+    Manifest *m = arg;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getdelim(&line, &cap, m->delim, m->in)) >= 0) {
+        if (len && line[len - 1] == m->delim) {
+            line[--len] = '\0';
         }
-        unsigned long index = (unsigned long) io_uring_cqe_get_data(cqe);
-        if (index < 0 || index >= (unsigned long)num_files) {
-            fprintf(stderr, "bad cqe user_data: %lu\n", index);
-            return 1;
+        if (len == 0) {
+            continue;
         }
-        if (cqe->res < 0) {
-            fprintf(stderr, "read file[%lu] failed: %s\n", index, strerror(-cqe->res));
-            return 1;
+        RIOVec *f = file_list_slot(m->list);
+        if (!f) {
+            if (m->list->count == m->list->max_files) {
+                fprintf(stderr, "more than %d files in %s\n", m->list->max_files, m->name);
+            }
+            m->failed = 1;
+            break;
+        }
+        // the list owns the line from here on
+        f->pathname = line; // -R splits off the ranges in place
+        f->fd = -1;
+        f->buf_index = -1;
+        f->merge_gap = m->merge_gap;
+        if (m->ranges && parse_ranges(f, line)) {
+            fprintf(stderr, "bad ranges: %s\n", line);
+            free_riovec(f);
+            m->failed = 1;
+            break;
         }
-        files[index].fOutBytes = (size_t)cqe->res;
-        printf("read %lu bytes from file %lu\n", files[index].fOutBytes, index);
+        file_list_push(m->list);
+        line = NULL;
+        cap = 0;
+    }
+    if (!m->failed && ferror(m->in)) {
+        perror(m->name);
+        m->failed = 1;
+    }
+    free(line);
+    // the engine finishes the files listed so far
+    file_list_end(m->list);
+    return NULL;
+}
 
-        // advance ring
-        io_uring_cqe_seen(ring, cqe);
+// on_ready consumer for -k, runs on whichever thread finished the file
+static void checksum_file(RIOVec *f, int index, void *arg) {
+    (void)arg;
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    const unsigned char *p = f->fBuffer;
+    for (size_t i = 0; i < f->fOutBytes; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
     }
-    return 0;
+    printf("file %d checksum %016llx\n", index, h);
+    free_riovec(f);
+}
+
+static void usage(const char *prog) {
+    printf("%s: [-d depth] [-c chunk_size] [-F arena_size] [-f] [-a] [-s sq_idle_ms [-C sq_cpu]] [-D] [-b batch] [-B buf_size] [-w workers [-W]] [-m bounded[:unbounded]] [-H] [-N [-A]] [-S] [-P thp|2m|1g] [-n] [-M budget] [-k] [-e engine] [-R [-g merge_gap]] {-i manifest [-0] | file [files...]}\n", prog);
+}
+
+// options that only the io_uring engine knows how to honour
+static int uring_only_options(const ReadOptions *opts) {
+    return opts->arena_size || opts->fixed_files || opts->async_meta
+        || opts->sqpoll || opts->batch > 1 || opts->select_size || opts->workers > 1
+        || opts->share_wq || opts->iowq_max[0] || opts->iowq_max[1] || opts->hybrid
+        || opts->nowait || opts->scan;
 }
 
 int main(int argc, char* argv[]) {
 
-    if (argc < 2) {
-        printf("%s: file [files...]\n", argv[0]) ;
-        return 1;
+    ReadOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.depth = DEFAULT_QUEUE_DEPTH;
+    opts.chunk_size = DEFAULT_CHUNK_SIZE;
+    opts.batch = 1;
+    const char *engine_name = "auto";
+    int ranges = 0;
+    size_t merge_gap = 0;
+    const char *manifest = NULL;
+    int delim = '\n';
+    int opt;
+    while ((opt = getopt(argc, argv, "d:c:F:fas:C:Db:B:e:Rg:w:Wm:HNASi:0P:nM:k")) != -1) {
+        switch (opt) {
+        case 'd':
+            if (parse_uint(optarg, 32768, &opts.depth) || opts.depth == 0) {
+                fprintf(stderr, "bad queue depth: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (parse_size(optarg, &opts.chunk_size) || opts.chunk_size == 0 || opts.chunk_size > MAX_CHUNK_SIZE) {
+                fprintf(stderr, "bad chunk size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'F':
+            if (parse_size(optarg, &opts.arena_size) || opts.arena_size == 0) {
+                fprintf(stderr, "bad arena size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            opts.fixed_files = 1;
+            break;
+        case 'a':
+            opts.async_meta = 1;
+            break;
+        case 's':
+            if (parse_uint(optarg, UINT_MAX, &opts.sq_idle)) {
+                fprintf(stderr, "bad sq thread idle time: %s\n", optarg);
+                return 1;
+            }
+            opts.sqpoll = 1;
+            break;
+        case 'C':
+            if (parse_uint(optarg, CPU_SETSIZE - 1, &opts.sq_cpu)) {
+                fprintf(stderr, "bad sq thread cpu: %s\n", optarg);
+                return 1;
+            }
+            opts.sq_pin = 1;
+            break;
+        case 'D':
+            opts.direct = 1;
+            break;
+        case 'b':
+            if (parse_uint(optarg, 32768, &opts.batch) || opts.batch == 0) {
+                fprintf(stderr, "bad completion batch: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            if (parse_size(optarg, &opts.select_size) || opts.select_size == 0 || opts.select_size > MAX_CHUNK_SIZE) {
+                fprintf(stderr, "bad provided buffer size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            engine_name = optarg;
+            break;
+        case 'W':
+            opts.share_wq = 1;
+            break;
+        case 'H':
+            opts.hybrid = 1;
+            break;
+        case 'N':
+            opts.nowait = 1;
+            break;
+        case 'A':
+            opts.retry_async = 1;
+            break;
+        case 'S':
+            opts.scan = 1;
+            break;
+        case 'm':
+            if (parse_iowq_max(optarg, opts.iowq_max)) {
+                fprintf(stderr, "bad io-wq worker limits: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'w':
+            if (parse_uint(optarg, CPU_SETSIZE, &opts.workers) || opts.workers == 0) {
+                fprintf(stderr, "bad worker count: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            ranges = 1;
+            break;
+        case 'i':
+            manifest = optarg;
+            break;
+        case '0':
+            delim = '\0';
+            break;
+        case 'n':
+            numa_placement = 1;
+            break;
+        case 'M':
+            if (parse_size(optarg, &buffer_budget) || buffer_budget == 0) {
+                fprintf(stderr, "bad buffer budget: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            opts.on_ready = checksum_file;
+            break;
+        case 'P':
+            if (parse_huge(optarg, &huge_buffers)) {
+                fprintf(stderr, "bad huge page policy: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            if (parse_size(optarg, &merge_gap)) {
+                fprintf(stderr, "bad range merge gap: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
     }
-    int num_files = argc - 1;
-    printf("reading %d files\n", num_files);
-
-    struct io_uring ring;
-    struct io_uring_probe *p;
-    int ret;
 
-    // todo check whether queue size != num_files matters
-    ret = io_uring_queue_init(num_files, &ring, 0 /* no setup flags */);
-    if (ret) {
-        fprintf(stderr, "ring create failed: %d\n", ret);
+    // files come either from the command line or from -i
+    if (manifest ? optind < argc : optind >= argc) {
+        usage(argv[0]);
         return 1;
     }
-
-    // kinda dumb, could fallback to readv with length one
-    // -- keep read for simplicity
-    p = io_uring_get_probe_ring(&ring);
-    if (!p || !io_uring_opcode_supported(p, IORING_OP_READ)) {
-        fprintf(stderr, "read op not supported by kernel, exiting: %d\n", ret);
+    if (delim != '\n' && !manifest) {
+        fprintf(stderr, "-0 only applies to a manifest (-i)\n");
         return 1;
     }
-    free(p);
-
-    RIOVec *files = (RIOVec*)calloc(num_files, sizeof(RIOVec));
-    if (!files) {
-        perror("calloc");
+    // an admitted file holds both its open and statx slots
+    if (opts.async_meta && opts.depth < 2) {
+        fprintf(stderr, "-a needs a queue depth of at least 2\n");
+        return 1;
+    }
+    if (opts.sq_pin && !opts.sqpoll) {
+        fprintf(stderr, "-C only applies to the sq thread (-s)\n");
         return 1;
     }
-    for (int i = 0; i < num_files; i++) {
-        int err = make_riovec(argv[i+1], &files[i]);
+    // residency is checked on the fd opened at admission, and means nothing
+    // to O_DIRECT reads
+    if (opts.hybrid && (opts.fixed_files || opts.async_meta || opts.direct || opts.select_size)) {
+        fprintf(stderr, "-H cannot be combined with -f, -a, -D or -B\n");
+        return 1;
+    }
+    // O_DIRECT already bypasses the cache, -B reads have no offsets to drop
+    if (opts.scan && (opts.direct || opts.select_size)) {
+        fprintf(stderr, "-S cannot be combined with -D or -B\n");
+        return 1;
+    }
+    if (opts.retry_async && !opts.nowait) {
+        fprintf(stderr, "-A only applies to RWF_NOWAIT retries (-N)\n");
+        return 1;
+    }
+    if (opts.share_wq && opts.workers < 2) {
+        fprintf(stderr, "-W needs more than one worker (-w)\n");
+        return 1;
+    }
+    // every worker has its own sq thread, they would all end up on one cpu
+    if (opts.sq_pin && opts.workers > 1) {
+        fprintf(stderr, "-C cannot be combined with -w\n");
+        return 1;
+    }
+    // an IOPOLL ring only accepts reads and writes on O_DIRECT files
+    if (opts.direct && (opts.fixed_files || opts.async_meta)) {
+        fprintf(stderr, "-D cannot be combined with -f or -a\n");
+        return 1;
+    }
+    // provided buffers replace both the size lookup and the buffer allocation
+    if (opts.select_size && (opts.arena_size || opts.async_meta || opts.direct)) {
+        fprintf(stderr, "-B cannot be combined with -F, -a or -D\n");
+        return 1;
+    }
+    // ranges sit at arbitrary offsets and need the file size to be known
+    if (ranges && (opts.direct || opts.select_size)) {
+        fprintf(stderr, "-R cannot be combined with -D or -B\n");
+        return 1;
+    }
+    if (merge_gap && !ranges) {
+        fprintf(stderr, "-g only applies to ranges (-R)\n");
+        return 1;
+    }
+
+    FileList list;
+    RIOVec *files = NULL;
+    Manifest m = { .delim = delim, .ranges = ranges, .merge_gap = merge_gap, .list = &list };
+    pthread_t reader;
+    if (manifest) {
+        int use_stdin = strcmp(manifest, "-") == 0;
+        m.name = use_stdin ? "stdin" : manifest;
+        m.in = use_stdin ? stdin : fopen(manifest, "r");
+        if (!m.in) {
+            perror(manifest);
+            return 1;
+        }
+        if (file_list_reserve(&list, MAX_LISTED_FILES)) {
+            return 1;
+        }
+        int err = pthread_create(&reader, NULL, read_manifest, &m);
         if (err) {
-            fprintf(stderr, "initialization failed for file[%d] (%s)\n", i, argv[i+1]);
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return 1;
+        }
+    } else {
+        int num_files = argc - optind;
+
+        files = (RIOVec*)calloc(num_files, sizeof(RIOVec));
+        if (!files) {
+            perror("calloc");
             return 1;
         }
+        for (int i = 0; i < num_files; i++) {
+            files[i].pathname = argv[optind + i]; // -R splits off the ranges in place
+            files[i].fd = -1; // opened when the file enters the window
+            files[i].buf_index = -1;
+            files[i].merge_gap = merge_gap;
+            if (ranges && parse_ranges(&files[i], argv[optind + i])) {
+                fprintf(stderr, "bad ranges: %s\n", argv[optind + i]);
+                return 1;
+            }
+        }
+        file_list_init(&list, files, num_files);
     }
 
-    ret = prep_reads(&ring, files, num_files);
-    if (ret) {
-        fprintf(stderr, "prep reads failed: %d\n", ret);
-        return 1;
+    // probes that need a file try the first one, which may still be listed
+    const char *sample = file_list_get(&list, 0, 1) == 1 ? list.files[0].pathname : NULL;
+    const ReadEngine *engine = NULL;
+    if (strcmp(engine_name, "auto") == 0) {
+        // aio only helps O_DIRECT, mmap cannot do it
+        const ReadEngine *buffered[] = {&uring_engine, &pread_engine, &mmap_engine};
+        const ReadEngine *direct[] = {&uring_engine, &aio_engine, &pread_engine};
+        const ReadEngine **order = opts.direct ? direct : buffered;
+        for (int i = 0; i < 3 && !engine; i++) {
+            if (order[i]->probe(&opts, sample) == 0) {
+                engine = order[i];
+            }
+        }
+        if (!engine) {
+            fprintf(stderr, "no usable read engine\n");
+            return 1;
+        }
+        if (engine != &uring_engine && uring_only_options(&opts)) {
+            fprintf(stderr, "io_uring unavailable, ignoring -F/-f/-a/-s/-b/-B/-w/-W/-m/-H/-N/-S\n");
+        }
+    } else {
+        const ReadEngine *all[] = {&uring_engine, &aio_engine, &pread_engine, &mmap_engine};
+        for (int i = 0; i < 4 && !engine; i++) {
+            if (strcmp(engine_name, all[i]->name) == 0) {
+                engine = all[i];
+            }
+        }
+        if (!engine) {
+            fprintf(stderr, "unknown engine: %s\n", engine_name);
+            return 1;
+        }
+        if (engine != &uring_engine && uring_only_options(&opts)) {
+            fprintf(stderr, "-F/-f/-a/-s/-b/-B/-w/-W/-m/-H/-N/-S need the uring engine\n");
+            return 1;
+        }
+        if (engine->probe(&opts, sample)) {
+            fprintf(stderr, "%s engine not usable here\n", engine->name);
+            return 1;
+        }
     }
 
-    ret = io_uring_submit(&ring);
-    if (ret <= 0) {
-        fprintf(stderr, "submit sqe failed: %d\n", ret);
-        return 1;
+    if (manifest) {
+        printf("reading files listed in %s with the %s engine\n", m.name, engine->name);
+    } else {
+        printf("reading %d files with the %s engine\n", list.count, engine->name);
     }
-    printf("submitted %d sqes\n", ret);
 
-    ret = reap_reads(&ring, files, num_files);
-    if (ret) {
-        fprintf(stderr, "reap reads failed: %d\n", ret);
+    if (engine->run(&list, &opts)) {
         return 1;
     }
+    if (manifest) {
+        pthread_join(reader, NULL);
+        if (m.in != stdin) {
+            fclose(m.in);
+        }
+    }
 
-    io_uring_queue_exit(&ring);
-
-    for (int i = 0; i < num_files; i++) {
-        free_riovec(&files[i]);
+    for (int i = 0; i < list.count; i++) {
+        free_riovec(&list.files[i]);
     }
+    release_slabs();
+    file_list_free(&list);
     free(files);
-    return 0;
+    engine->release();
+    if (buffer_budget) {
+        printf("held at most %zu buffer bytes\n", budget_peak());
+    }
+    latency_report(&read_latency, stdout);
+    return m.failed;
 }
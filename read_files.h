@@ -0,0 +1,209 @@
+#ifndef READ_FILES_H
+#define READ_FILES_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define DEFAULT_QUEUE_DEPTH 64
+#define DEFAULT_CHUNK_SIZE (1UL << 20)
+// a single read is capped by the kernel just under 2 GiB
+#define MAX_CHUNK_SIZE (1UL << 30)
+// the kernel rejects registered buffers larger than 1 GiB
+#define ARENA_SEGMENT_SIZE (1UL << 30)
+#define ARENA_ALIGN 64
+// largest direct I/O alignment we bounce, also the bounce buffer size per slot
+#define DIO_BOUNCE_SIZE 4096
+// files up to SLAB_FILE_MAX share SLAB_SIZE slabs instead of a malloc each,
+// one slab is one transparent huge page
+#define SLAB_SIZE (2UL << 20)
+#define SLAB_FILE_MAX (64UL << 10)
+// the -P huge page policy applies to buffers of at least one huge page
+#define HUGE_BUFFER_MIN (2UL << 20)
+// nodes -n can place buffers on
+#define MAX_NUMA_NODES 64
+
+// one piece of a file to read into dest, allocated in fBuffer when NULL
+typedef struct RIORange {
+    off_t offset;
+    size_t size;
+    void *dest;
+} RIORange;
+
+// one file to read, engines fill in everything below ranges
+typedef struct RIOVec {
+    const char *pathname;
+    RIORange *ranges;   // read only these (ROOT baskets), whole file if NULL
+    unsigned nranges;   // owned by the RIOVec, freed by free_riovec
+    size_t merge_gap;   // coalesce ranges at most this far apart into one read
+    int fd;
+    size_t queued;      // bytes handed to reads so far
+    unsigned inflight;  // chunk reads outstanding
+    int buf_index;      // registered arena segment holding fBuffer, -1 if malloc'd
+    int next_ready;     // ReadWindow ready list link
+    unsigned dio_align; // O_DIRECT offset/length/memory alignment, 0 if buffered
+    struct iovec *chain; // provided buffers filled so far with -B, joined at EOF
+    unsigned nchain;
+    int mapped;         // fBuffer is an mmap of the file (mmap engine)
+    struct Slab *slab;  // shared slab fBuffer was packed into, NULL if not
+    size_t map_len;     // fBuffer is its own mapping this long (-P, -n), or 0
+    size_t charged;     // bytes held against the -M budget
+    struct BufArena *arena; // arena fBuffer came from, NULL if none
+    RIORange *reads;    // ranges after coalescing, what next_piece hands out
+    unsigned nreads;
+    void **staged;      // per range, where a coalesced read left it, or NULL
+    unsigned cur_range; // next_piece position within reads
+    size_t range_queued;
+    // fields in ROOT data structure
+    void *fBuffer;
+    off_t fOffset;
+    size_t fSize;
+    size_t fOutBytes;
+} RIOVec;
+
+// files given with -i are reserved address space for this many up front
+#define MAX_LISTED_FILES (1 << 26)
+// and made writable this many entries at a time
+#define FILE_LIST_STEP 65536
+
+// the files to read, either all known up front (argv) or appended while the
+// engines run (-i); files never moves, so engines may index it freely
+typedef struct FileList {
+    RIOVec *files;
+    int count;          // files[0, count) are filled in, grows under lock
+    int done;           // no more files will be added
+    int max_files;      // reserved entries, 0 if files came from the caller
+    int committed;      // reserved entries made writable so far
+    pthread_mutex_t lock;
+    pthread_cond_t grown;
+} FileList;
+
+// registered buffer arena, one iovec per segment, bump-allocated per file
+typedef struct BufArena {
+    struct iovec *segs;
+    size_t *used;       // bytes handed out from each segment
+    unsigned *live;     // buffers from each segment not put back yet
+    unsigned nsegs;
+    unsigned fallbacks; // files that did not fit and were malloc'd
+} BufArena;
+
+// consumer of finished files, see ReadOptions.on_ready
+typedef void (*FileReady)(RIOVec *file, int index, void *arg);
+
+// options shared by every engine, the io_uring-only ones are ignored elsewhere
+typedef struct ReadOptions {
+    unsigned depth;         // reads in flight (-d)
+    size_t chunk_size;      // largest single read (-c)
+    int direct;             // O_DIRECT (-D)
+    // called once per file as soon as its last read is reaped, on the thread
+    // that reaped it (so from several at once with -w or the pread pool);
+    // the file's buffer then belongs to the callback, which hands it back
+    // with free_riovec, from any thread, once done. NULL keeps every file
+    // until the run ends (or releases it right away under -M)
+    FileReady on_ready;
+    void *ready_arg;
+    // io_uring engine only
+    size_t arena_size;      // registered buffer arena (-F)
+    int fixed_files;        // direct descriptors (-f)
+    int async_meta;         // open/statx in the ring (-a)
+    int sqpoll;             // SQPOLL thread (-s)
+    unsigned sq_idle;
+    int sq_pin;             // SQ_AFF (-C)
+    unsigned sq_cpu;
+    unsigned batch;         // completions to wait for per submit (-b)
+    size_t select_size;     // provided buffer size (-B)
+    unsigned workers;       // threads with a ring each (-w)
+    int share_wq;           // attach every ring to the first ring's io-wq (-W)
+    unsigned iowq_max[2];   // bounded, unbounded io-wq worker caps, 0 keeps (-m)
+    int hybrid;             // read fully cached files inline (-H)
+    int nowait;             // RWF_NOWAIT first, -EAGAIN retried normally (-N)
+    int retry_async;        // those retries with IOSQE_ASYNC (-A)
+    int scan;               // keep reads out of the page cache (-S)
+} ReadOptions;
+
+// a read engine fills fBuffer/fSize/fOutBytes for every file
+typedef struct ReadEngine {
+    const char *name;
+    // 0 when the engine can run on this host with these options; sample is
+    // one of the files to be read, for checks that need a real file (NULL
+    // when there is none)
+    int (*probe)(const ReadOptions *opts, const char *sample);
+    int (*run)(FileList *list, const ReadOptions *opts);
+    // tear down state file buffers may still point into, after free_riovec
+    void (*release)(void);
+} ReadEngine;
+
+// how alloc_riovec and init_arena back large buffers (-P), set before any
+// engine runs
+enum { HUGE_NONE, HUGE_THP, HUGE_2M, HUGE_1G };
+extern int huge_buffers;
+// buffers on the NUMA node of the file's device (-n)
+extern int numa_placement;
+// with -M, at most about this many buffer bytes are held at once, and
+// engines release each file as soon as it is read
+extern size_t buffer_budget;
+
+// per-read latency, submit to completion, split by file size (latency.c)
+#define LAT_SIZE_BUCKETS 5
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 40         // ~18 minutes in ns, longer reads are clamped
+#define LAT_MAX_NS (1ULL << LAT_MAX_BITS)
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+
+typedef struct LatencyHist {
+    unsigned long long counts[LAT_SIZE_BUCKETS][LAT_BUCKETS];
+    unsigned long long reads[LAT_SIZE_BUCKETS];
+    unsigned long long max[LAT_SIZE_BUCKETS];
+} LatencyHist;
+
+// filled by the engines, reported by the caller
+extern LatencyHist read_latency;
+
+unsigned long long now_ns(void);
+void latency_record(LatencyHist *h, size_t file_size, unsigned long long ns);
+void latency_merge(LatencyHist *dst, const LatencyHist *src);
+void latency_reset(LatencyHist *h);
+unsigned long long latency_percentile(const LatencyHist *h, int bucket, double p);
+void latency_report(const LatencyHist *h, FILE *out);
+
+extern const ReadEngine uring_engine;
+extern const ReadEngine aio_engine;
+extern const ReadEngine pread_engine;
+extern const ReadEngine mmap_engine;
+
+// riovec.c
+int device_node(dev_t dev);
+int path_node(const char *pathname);
+void *map_buffer(size_t *len, int node);
+int init_arena(BufArena *arena, size_t size, int node);
+void *arena_alloc(BufArena *arena, size_t size, size_t align, int *buf_index);
+void arena_put(BufArena *arena, int buf_index);
+void free_arena(BufArena *arena);
+int alloc_riovec(RIOVec *rd, size_t size, BufArena *arena, int node);
+size_t next_piece(RIOVec *rd, size_t chunk_size, off_t *offset, void **dest, int *bounce);
+void scatter_ranges(RIOVec *rd);
+unsigned dio_alignment(int fd);
+int cache_resident(int fd, size_t size);
+int make_riovec(const char *pathname, RIOVec *rd, BufArena *arena, int direct);
+int stat_riovec(const char *pathname, RIOVec *rd, BufArena *arena);
+int append_chain(RIOVec *rd, void *buf, size_t len);
+int join_chain(RIOVec *rd);
+void free_riovec(RIOVec *io);
+void deliver_file(RIOVec *f, int index, const ReadOptions *opts);
+int budget_room(int block);
+size_t budget_peak(void);
+void release_slabs(void);
+void file_list_init(FileList *list, RIOVec *files, int count);
+int file_list_reserve(FileList *list, int max_files);
+RIOVec *file_list_slot(FileList *list);
+void file_list_push(FileList *list);
+void file_list_end(FileList *list);
+int file_list_get(FileList *list, int index, int block);
+void file_list_free(FileList *list);
+int parse_uint(const char *arg, unsigned long max, unsigned *out);
+int parse_size(const char *arg, size_t *out);
+
+#endif
@@ -0,0 +1,953 @@
+#define _GNU_SOURCE // struct statx, O_DIRECT
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "read_files.h"
+
+/*
+ * RIOVec setup and teardown shared by all engines
+ */
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+int huge_buffers;
+static int huge_fallback_noted;
+
+// len bytes of anonymous memory starting on an align boundary (a power of
+// two), mapped with align extra and trimmed
+static void *map_aligned(size_t len, size_t align) {
+    if (align <= 4096) {
+        void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return map == MAP_FAILED ? NULL : map;
+    }
+    char *map = mmap(NULL, len + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    char *start = (char *)(((uintptr_t)map + align - 1) & ~(uintptr_t)(align - 1));
+    if (start > map) {
+        munmap(map, start - map);
+    }
+    munmap(start + len, map + align - start);
+    return start;
+}
+
+/*
+ * With -n, buffers go on the NUMA node of the device the file lives on, as
+ * found in sysfs, instead of wherever the kernel copy first touches them.
+ * The binding is MPOL_PREFERRED, so a full node still spills over.
+ */
+
+int numa_placement;
+
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct { dev_t dev; int node; } node_cache[16];
+static unsigned node_cached;
+
+// the first numa_node walking up the device's sysfs path; -1 when there is
+// none or it says -1 (device mapper, network and memory file systems,
+// single node hosts)
+int device_node(dev_t dev) {
+    pthread_mutex_lock(&node_lock);
+    for (unsigned i = 0; i < node_cached; i++) {
+        if (node_cache[i].dev == dev) {
+            int node = node_cache[i].node;
+            pthread_mutex_unlock(&node_lock);
+            return node;
+        }
+    }
+    pthread_mutex_unlock(&node_lock);
+
+    char path[64], dir[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+    int node = -1;
+    if (realpath(path, dir)) {
+        // partitions sit under their disk, disks under their controller
+        char *end = dir + strlen(dir);
+        while (end - dir > (long)strlen("/sys/devices")) {
+            snprintf(end, sizeof(dir) - (end - dir), "/numa_node");
+            FILE *f = fopen(dir, "r");
+            *end = '\0';
+            if (f) {
+                if (fscanf(f, "%d", &node) != 1) {
+                    node = -1;
+                }
+                fclose(f);
+                break;
+            }
+            end = strrchr(dir, '/');
+            *end = '\0';
+        }
+    }
+    if (node >= MAX_NUMA_NODES) {
+        node = -1;
+    }
+
+    pthread_mutex_lock(&node_lock);
+    if (node_cached < sizeof(node_cache) / sizeof(node_cache[0])) {
+        node_cache[node_cached].dev = dev;
+        node_cache[node_cached++].node = node;
+    }
+    pthread_mutex_unlock(&node_lock);
+    return node;
+}
+
+int path_node(const char *pathname) {
+    struct stat st;
+    return stat(pathname, &st) ? -1 : device_node(st.st_dev);
+}
+
+// before anything touches the range, a no-op for node -1
+static void bind_node(void *addr, size_t len, int node) {
+    if (node < 0) {
+        return;
+    }
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+}
+
+/*
+ * Large buffers under the -P policy: hugetlb pages (MAP_HUGETLB, 2M or 1G,
+ * from the pool in /proc/sys/vm/nr_hugepages or the per-size sysfs knobs),
+ * or transparent huge pages on a 2M aligned mapping. Either way the buffer
+ * is prefaulted (hugetlb with MAP_POPULATE, unless it has to be bound to a
+ * node first), so the kernel copy does not take a fault per page, and a
+ * multi-GB file costs a few thousand TLB entries instead of a million. An
+ * empty hugetlb pool falls back to transparent huge pages. Without -P this
+ * is a plain mapping, only there to be bound to node. *len is rounded up to
+ * what was mapped, which is what munmap needs back.
+ */
+void *map_buffer(size_t *len, int node) {
+    char *buf = NULL;
+    size_t mlen = 0;
+    int populated = 0;
+    if (huge_buffers == HUGE_2M || huge_buffers == HUGE_1G) {
+        size_t page = huge_buffers == HUGE_1G ? 1UL << 30 : 2UL << 20;
+        int size_flag = huge_buffers == HUGE_1G ? MAP_HUGE_1GB : MAP_HUGE_2MB;
+        mlen = (*len + page - 1) & ~(page - 1);
+        // pages bound to a node are only taken once mbind has run
+        populated = node < 0;
+        buf = mmap(NULL, mlen, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | size_flag | (populated ? MAP_POPULATE : 0), -1, 0);
+        if (buf == MAP_FAILED) {
+            buf = NULL;
+            populated = 0;
+            if (!__atomic_exchange_n(&huge_fallback_noted, 1, __ATOMIC_RELAXED)) {
+                fprintf(stderr, "no %s huge pages (%s), using transparent huge pages\n",
+                    huge_buffers == HUGE_1G ? "1G" : "2M", strerror(errno));
+            }
+        }
+    }
+    if (!buf) {
+        mlen = (*len + 4095) & ~(size_t)4095;
+        buf = map_aligned(mlen, huge_buffers ? 2UL << 20 : 4096);
+        if (!buf) {
+            return NULL;
+        }
+        if (huge_buffers) {
+            // only a hint, THP may be disabled
+            madvise(buf, mlen, MADV_HUGEPAGE);
+        }
+    }
+    bind_node(buf, mlen, node);
+    if (huge_buffers && !populated && madvise(buf, mlen, MADV_POPULATE_WRITE)) {
+        // before 5.14, one write per small page faults in the huge page
+        // around it or just that page
+        for (size_t off = 0; off < mlen; off += 4096) {
+            ((volatile char *)buf)[off] = 0;
+        }
+    }
+    *len = mlen;
+    return buf;
+}
+
+// map the arena on node (-1 for anywhere), registering it is up to the engine
+int init_arena(BufArena *arena, size_t size, int node) {
+    memset(arena, 0, sizeof(*arena));
+    arena->nsegs = (size + ARENA_SEGMENT_SIZE - 1) / ARENA_SEGMENT_SIZE;
+    arena->segs = calloc(arena->nsegs, sizeof(struct iovec));
+    arena->used = calloc(arena->nsegs, sizeof(size_t));
+    arena->live = calloc(arena->nsegs, sizeof(unsigned));
+    if (!arena->segs || !arena->used || !arena->live) {
+        perror("calloc");
+        return 1;
+    }
+    for (unsigned i = 0; i < arena->nsegs; i++) {
+        size_t len = size - (size_t)i * ARENA_SEGMENT_SIZE;
+        if (len > ARENA_SEGMENT_SIZE) {
+            len = ARENA_SEGMENT_SIZE;
+        }
+        // registered huge pages also take a single bvec each
+        void *seg = map_buffer(&len, node);
+        if (!seg) {
+            perror("mmap");
+            return 1;
+        }
+        arena->segs[i].iov_base = seg;
+        arena->segs[i].iov_len = len;
+    }
+    return 0;
+}
+
+// returns NULL when no segment has room left, align is a power of two
+void *arena_alloc(BufArena *arena, size_t size, size_t align, int *buf_index) {
+    if (align < ARENA_ALIGN) {
+        align = ARENA_ALIGN;
+    }
+    for (unsigned i = 0; i < arena->nsegs; i++) {
+        // only this thread hands out buffers, so nothing can come back
+        // to life between the check and the reset
+        if (__atomic_load_n(&arena->live[i], __ATOMIC_ACQUIRE) == 0) {
+            arena->used[i] = 0;
+        }
+        size_t start = (arena->used[i] + align - 1) & ~(align - 1);
+        if (start <= arena->segs[i].iov_len && arena->segs[i].iov_len - start >= size) {
+            void *buf = (char *)arena->segs[i].iov_base + start;
+            arena->used[i] = start + size;
+            __atomic_add_fetch(&arena->live[i], 1, __ATOMIC_RELAXED);
+            *buf_index = (int)i;
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+// a buffer from segment buf_index is no longer used, from any thread; the
+// segment starts over once all of them are back
+void arena_put(BufArena *arena, int buf_index) {
+    __atomic_sub_fetch(&arena->live[buf_index], 1, __ATOMIC_RELEASE);
+}
+
+// ring must be torn down first so the segments are no longer registered
+void free_arena(BufArena *arena) {
+    for (unsigned i = 0; i < arena->nsegs; i++) {
+        if (arena->segs[i].iov_base) {
+            munmap(arena->segs[i].iov_base, arena->segs[i].iov_len);
+        }
+    }
+    free(arena->segs);
+    free(arena->used);
+    free(arena->live);
+}
+
+/*
+ * Small files are packed back to back into SLAB_SIZE slabs, one being
+ * filled per thread and NUMA node, so millions of tiny files cost neither
+ * an allocator call each nor a fragmented heap, and sit close together for
+ * whoever walks the results. A slab counts the files in it, plus one while
+ * it is being filled, and is unmapped in one go when that drops to zero.
+ */
+
+typedef struct Slab {
+    struct Slab *prev;  // live slabs, under slab_lock
+    struct Slab *next;
+    unsigned refs;
+    int filling;        // some thread still allocates from it
+    size_t used;
+} Slab;
+
+#define SLAB_HEADER ((sizeof(Slab) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static Slab *slabs;
+static unsigned slab_epoch;             // bumped by release_slabs
+static _Thread_local Slab *filling[MAX_NUMA_NODES + 1]; // this thread's, by node + 1
+static _Thread_local unsigned filling_epoch;
+
+// called with slab_lock held
+static void unmap_slab(Slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        slabs = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    munmap(slab, SLAB_SIZE);
+}
+
+static void drop_slab(Slab *slab) {
+    if (__atomic_sub_fetch(&slab->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    pthread_mutex_lock(&slab_lock);
+    unmap_slab(slab);
+    pthread_mutex_unlock(&slab_lock);
+}
+
+static Slab *new_slab(int node) {
+    // aligned so the slab can be one huge page
+    char *start = map_aligned(SLAB_SIZE, SLAB_SIZE);
+    if (!start) {
+        return NULL;
+    }
+    // only a hint, the slab works with small pages too
+    madvise(start, SLAB_SIZE, MADV_HUGEPAGE);
+    bind_node(start, SLAB_SIZE, node);
+
+    Slab *slab = (Slab *)start;
+    slab->prev = NULL;
+    slab->refs = 1;
+    slab->filling = 1;
+    slab->used = SLAB_HEADER;
+    pthread_mutex_lock(&slab_lock);
+    slab->next = slabs;
+    if (slabs) {
+        slabs->prev = slab;
+    }
+    slabs = slab;
+    pthread_mutex_unlock(&slab_lock);
+    return slab;
+}
+
+// room for a small file in this thread's slab for node, NULL if no slab can
+// be mapped
+static void *slab_alloc(size_t size, size_t align, int node, Slab **owner) {
+    if (align < ARENA_ALIGN) {
+        align = ARENA_ALIGN;
+    }
+    unsigned epoch = __atomic_load_n(&slab_epoch, __ATOMIC_ACQUIRE);
+    if (filling_epoch != epoch) {
+        // already let go by release_slabs
+        memset(filling, 0, sizeof(filling));
+        filling_epoch = epoch;
+    }
+    Slab *slab = filling[node + 1];
+    size_t start = slab ? (slab->used + align - 1) & ~(align - 1) : 0;
+    if (!slab || start + size > SLAB_SIZE) {
+        if (slab) {
+            slab->filling = 0;
+            drop_slab(slab);
+        }
+        filling[node + 1] = slab = new_slab(node);
+        if (!slab) {
+            return NULL;
+        }
+        start = (slab->used + align - 1) & ~(align - 1);
+    }
+    slab->used = start + size;
+    __atomic_add_fetch(&slab->refs, 1, __ATOMIC_RELAXED);
+    *owner = slab;
+    return (char *)slab + start;
+}
+
+// let go of the slabs threads are still filling, once no engine is running;
+// each is unmapped with its last file (right away if those are freed)
+void release_slabs(void) {
+    pthread_mutex_lock(&slab_lock);
+    __atomic_add_fetch(&slab_epoch, 1, __ATOMIC_RELEASE);
+    Slab *next;
+    for (Slab *slab = slabs; slab; slab = next) {
+        next = slab->next;
+        if (slab->filling) {
+            slab->filling = 0;
+            if (__atomic_sub_fetch(&slab->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+                unmap_slab(slab);
+            }
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * With -M, buffers count against a byte budget from allocation until the
+ * file is released, and engines only admit a new file while the bytes held
+ * are under it. A file is admitted before its size is known, so the total
+ * can go past the budget by the files admitted at the same time: one per
+ * worker, or one per open in flight with -a.
+ */
+
+size_t buffer_budget;
+static size_t buffer_bytes;
+static size_t buffer_peak;
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_freed = PTHREAD_COND_INITIALIZER;
+
+static void budget_charge(RIOVec *rd, size_t size) {
+    rd->charged = size;
+    size_t held = __atomic_add_fetch(&buffer_bytes, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&buffer_peak, __ATOMIC_RELAXED);
+    while (held > peak && !__atomic_compare_exchange_n(&buffer_peak, &peak, held, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void budget_credit(RIOVec *rd) {
+    if (!rd->charged) {
+        return;
+    }
+    __atomic_sub_fetch(&buffer_bytes, rd->charged, __ATOMIC_RELEASE);
+    rd->charged = 0;
+    if (buffer_budget) {
+        pthread_mutex_lock(&budget_lock);
+        pthread_cond_broadcast(&budget_freed);
+        pthread_mutex_unlock(&budget_lock);
+    }
+}
+
+// whether another file may be admitted now; with block, waits for a
+// release instead of saying no
+int budget_room(int block) {
+    if (!buffer_budget || __atomic_load_n(&buffer_bytes, __ATOMIC_ACQUIRE) < buffer_budget) {
+        return 1;
+    }
+    if (!block) {
+        return 0;
+    }
+    pthread_mutex_lock(&budget_lock);
+    while (__atomic_load_n(&buffer_bytes, __ATOMIC_ACQUIRE) >= buffer_budget) {
+        pthread_cond_wait(&budget_freed, &budget_lock);
+    }
+    pthread_mutex_unlock(&budget_lock);
+    return 1;
+}
+
+// most buffer bytes held at once so far
+size_t budget_peak(void) {
+    return __atomic_load_n(&buffer_peak, __ATOMIC_RELAXED);
+}
+
+// join a file's buffer chain into one fBuffer sized to the data read
+int join_chain(RIOVec *rd) {
+    rd->fSize = rd->fOutBytes;
+    if (rd->nchain == 1) {
+        // shrink in place, keep the original if realloc can't
+        void *buf = realloc(rd->chain[0].iov_base, rd->fSize);
+        rd->fBuffer = buf ? buf : rd->chain[0].iov_base;
+    } else if (rd->nchain > 1) {
+        rd->fBuffer = malloc(rd->fSize);
+        if (!rd->fBuffer) {
+            perror("malloc");
+            return 1;
+        }
+        size_t pos = 0;
+        for (unsigned i = 0; i < rd->nchain; i++) {
+            memcpy((char *)rd->fBuffer + pos, rd->chain[i].iov_base, rd->chain[i].iov_len);
+            pos += rd->chain[i].iov_len;
+            free(rd->chain[i].iov_base);
+        }
+    }
+    free(rd->chain);
+    rd->chain = NULL;
+    rd->nchain = 0;
+    budget_charge(rd, rd->fSize);
+    return 0;
+}
+
+int append_chain(RIOVec *rd, void *buf, size_t len) {
+    // grow by doubling, counts are powers of two
+    if ((rd->nchain & (rd->nchain - 1)) == 0) {
+        unsigned cap = rd->nchain ? rd->nchain * 2 : 1;
+        struct iovec *chain = realloc(rd->chain, cap * sizeof(struct iovec));
+        if (!chain) {
+            perror("realloc");
+            return 1;
+        }
+        rd->chain = chain;
+    }
+    rd->chain[rd->nchain].iov_base = buf;
+    rd->chain[rd->nchain].iov_len = len;
+    rd->nchain++;
+    return 0;
+}
+
+static int cmp_range(const void *a, const void *b) {
+    off_t x = (*(RIORange * const *)a)->offset, y = (*(RIORange * const *)b)->offset;
+    return (x > y) - (x < y);
+}
+
+// ranges with data to read, by file offset
+static RIORange **sort_ranges(RIOVec *rd, unsigned *n) {
+    RIORange **order = malloc(rd->nranges * sizeof(RIORange *));
+    if (!order) {
+        perror("malloc");
+        return NULL;
+    }
+    *n = 0;
+    for (unsigned i = 0; i < rd->nranges; i++) {
+        if (rd->ranges[i].size) {
+            order[(*n)++] = &rd->ranges[i];
+        }
+    }
+    qsort(order, *n, sizeof(RIORange *), cmp_range);
+    return order;
+}
+
+// TTreeCache style planner: merge sorted neighbours at most merge_gap apart
+// into single reads. A read covering one range goes straight to its
+// destination, merged reads land in staging and are copied out by
+// scatter_ranges. Without staging only sizes the staging area; returns the
+// bytes the reads cover.
+static size_t plan_reads(RIOVec *rd, RIORange **order, unsigned n, char *staging, size_t *staging_size) {
+    size_t covered = 0;
+    *staging_size = 0;
+    rd->nreads = 0;
+    for (unsigned i = 0; i < n;) {
+        off_t start = order[i]->offset;
+        off_t end = start + order[i]->size;
+        unsigned j = i + 1;
+        while (j < n && order[j]->offset <= end + (off_t)rd->merge_gap) {
+            off_t e = order[j]->offset + order[j]->size;
+            end = e > end ? e : end;
+            j++;
+        }
+        covered += end - start;
+        if (staging) {
+            RIORange *r = &rd->reads[rd->nreads++];
+            r->offset = start;
+            r->size = end - start;
+            r->dest = order[i]->dest;
+            if (j - i > 1) {
+                r->dest = staging + *staging_size;
+                for (unsigned k = i; k < j; k++) {
+                    rd->staged[order[k] - rd->ranges] = (char *)r->dest + (order[k]->offset - start);
+                }
+            }
+        }
+        if (j - i > 1) {
+            *staging_size += end - start;
+        }
+        i = j;
+    }
+    return covered;
+}
+
+// all reads of a file have landed: copy merged ranges out of staging and
+// account the file in ranges rather than in reads
+void scatter_ranges(RIOVec *rd) {
+    if (!rd->nranges) {
+        return;
+    }
+    size_t total = 0;
+    for (unsigned i = 0; i < rd->nranges; i++) {
+        if (rd->staged[i]) {
+            memcpy(rd->ranges[i].dest, rd->staged[i], rd->ranges[i].size);
+        }
+        total += rd->ranges[i].size;
+    }
+    // gap bytes do not count; a file that ended early was already reported
+    // and its count is only capped, reads do not track which ranges they hit
+    if (rd->fOutBytes == rd->fSize || rd->fOutBytes > total) {
+        rd->fOutBytes = total;
+    }
+    rd->fSize = total;
+}
+
+// sets up fBuffer and the read range for a file of the given size,
+// aligned to rd->dio_align for O_DIRECT. With ranges the file size does not
+// matter: fBuffer holds, back to back, the ranges that did not come with a
+// destination followed by the staging area for merged reads, and fSize is
+// what the reads cover until scatter_ranges.
+int alloc_riovec(RIOVec *rd, size_t size, BufArena *arena, int node) {
+    RIORange **order = NULL;
+    unsigned nsorted = 0;
+    if (rd->nranges) {
+        order = sort_ranges(rd, &nsorted);
+        rd->reads = calloc(rd->nranges, sizeof(RIORange));
+        rd->staged = calloc(rd->nranges, sizeof(void *));
+        if (!order || !rd->reads || !rd->staged) {
+            perror("calloc");
+            free(order);
+            return 1;
+        }
+        plan_reads(rd, order, nsorted, NULL, &size);
+        for (unsigned i = 0; i < rd->nranges; i++) {
+            if (rd->ranges[i].dest) {
+                // fixed reads only reach the arena, not caller memory
+                arena = NULL;
+            } else {
+                size += rd->ranges[i].size;
+            }
+        }
+    }
+    rd->buf_index = -1;
+    rd->fBuffer = NULL;
+    rd->slab = NULL;
+    rd->map_len = 0;
+    rd->arena = NULL;
+    if (arena) {
+        rd->fBuffer = arena_alloc(arena, size, rd->dio_align, &rd->buf_index);
+        if (!rd->fBuffer) {
+            arena->fallbacks++;
+        } else {
+            rd->arena = arena;
+        }
+    }
+    if (!rd->fBuffer && size && size <= SLAB_FILE_MAX) {
+        rd->fBuffer = slab_alloc(size, rd->dio_align, node, &rd->slab);
+    }
+    if (!rd->fBuffer && size && ((huge_buffers && size >= HUGE_BUFFER_MIN) || node >= 0)) {
+        rd->map_len = size;
+        rd->fBuffer = map_buffer(&rd->map_len, node);
+        if (!rd->fBuffer) {
+            rd->map_len = 0;
+        }
+    }
+    if (!rd->fBuffer && rd->dio_align) {
+        if (posix_memalign(&rd->fBuffer, rd->dio_align, size)) {
+            rd->fBuffer = NULL;
+        }
+    } else if (!rd->fBuffer) {
+        rd->fBuffer = malloc(size);
+    }
+    if (!rd->fBuffer) {
+        perror("malloc");
+        return 1;
+    }
+    budget_charge(rd, size);
+    size_t pos = 0;
+    for (unsigned i = 0; i < rd->nranges; i++) {
+        if (!rd->ranges[i].dest) {
+            rd->ranges[i].dest = (char *)rd->fBuffer + pos;
+            pos += rd->ranges[i].size;
+        }
+    }
+    rd->fSize = size;
+    if (rd->nranges) {
+        size_t staging_size;
+        rd->fSize = plan_reads(rd, order, nsorted, (char *)rd->fBuffer + pos, &staging_size);
+        free(order);
+    }
+    rd->fOffset = 0; // read whole file
+    rd->fOutBytes = 0; // accumulated from cqes
+    rd->queued = 0;
+    rd->inflight = 0;
+    rd->cur_range = 0;
+    rd->range_queued = 0;
+    return 0;
+}
+
+// cut the next read off a file with bytes left to queue: at most chunk_size
+// bytes of the current range, trimmed to the O_DIRECT alignment. The
+// unaligned tail of a direct file comes back with *bounce set, to be read as
+// one aligned block through a bounce buffer.
+size_t next_piece(RIOVec *rd, size_t chunk_size, off_t *offset, void **dest, int *bounce) {
+    size_t left;
+    if (rd->nranges) {
+        while (rd->range_queued == rd->reads[rd->cur_range].size) {
+            rd->cur_range++;
+            rd->range_queued = 0;
+        }
+        RIORange *r = &rd->reads[rd->cur_range];
+        *offset = r->offset + rd->range_queued;
+        *dest = (char *)r->dest + rd->range_queued;
+        left = r->size - rd->range_queued;
+    } else {
+        *offset = rd->fOffset + rd->queued;
+        *dest = (char *)rd->fBuffer + rd->queued;
+        left = rd->fSize - rd->queued;
+    }
+
+    if (rd->dio_align) {
+        chunk_size -= chunk_size % rd->dio_align;
+        if (chunk_size == 0) {
+            chunk_size = rd->dio_align;
+        }
+    }
+    size_t len = left < chunk_size ? left : chunk_size;
+    *bounce = 0;
+    if (rd->dio_align && len % rd->dio_align) {
+        // only the last piece of a file is unaligned: read the aligned part
+        // directly and leave the tail for a bounced read
+        if (len > rd->dio_align) {
+            len -= len % rd->dio_align;
+        } else {
+            *bounce = 1;
+        }
+    }
+    rd->queued += len;
+    rd->range_queued += len;
+    return len;
+}
+
+// direct I/O alignment of an open file, 0 if it does not support O_DIRECT
+unsigned dio_alignment(int fd) {
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) && (stx.stx_mask & STATX_DIOALIGN)) {
+        unsigned align = stx.stx_dio_offset_align;
+        if (stx.stx_dio_mem_align > align) {
+            align = stx.stx_dio_mem_align;
+        }
+        return align;
+    }
+#endif
+    (void)fd;
+    // kernel can't tell us, the page size covers any logical block size we bounce
+    return DIO_BOUNCE_SIZE;
+}
+
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+// uapi layout of cachestat(2), not in every libc's headers yet
+typedef struct CacheStatRange {
+    unsigned long long off;
+    unsigned long long len;
+} CacheStatRange;
+
+typedef struct CacheStat {
+    unsigned long long nr_cache;
+    unsigned long long nr_dirty;
+    unsigned long long nr_writeback;
+    unsigned long long nr_evicted;
+    unsigned long long nr_recently_evicted;
+} CacheStat;
+
+// 1 when every page of the file is in the page cache: cachestat (6.5+), or
+// mincore on a throwaway mapping on older kernels
+int cache_resident(int fd, size_t size) {
+    static int have_cachestat = 1;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page;
+    if (have_cachestat) {
+        CacheStatRange range = { 0, size };
+        CacheStat cs;
+        if (syscall(__NR_cachestat, fd, &range, &cs, 0) == 0) {
+            return cs.nr_cache >= pages;
+        }
+        if (errno != ENOSYS) {
+            return 0;
+        }
+        have_cachestat = 0;
+    }
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return 0;
+    }
+    unsigned char *vec = malloc(pages);
+    int resident = vec && mincore(addr, size, vec) == 0;
+    for (size_t i = 0; resident && i < pages; i++) {
+        resident = vec[i] & 1;
+    }
+    free(vec);
+    munmap(addr, size);
+    return resident;
+}
+
+// caller responsible for freeing RIOVec->fBuffer (see free_riovec)
+// buffers come from arena when one is given and has room
+int make_riovec(const char *pathname, RIOVec *rd, BufArena *arena, int direct) {
+    rd->pathname = pathname;
+    rd->fd = open(pathname, O_RDONLY | (direct ? O_DIRECT : 0));
+    if (rd->fd < 0) {
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(rd->fd, &st)) {
+        perror("fstat");
+        return 1;
+    }
+    rd->dio_align = 0;
+    if (direct) {
+        rd->dio_align = dio_alignment(rd->fd);
+        if (rd->dio_align == 0 || rd->dio_align > DIO_BOUNCE_SIZE) {
+            fprintf(stderr, "unsupported direct I/O alignment %u\n", rd->dio_align);
+            return 1;
+        }
+    }
+    return alloc_riovec(rd, st.st_size, arena, numa_placement ? device_node(st.st_dev) : -1);
+}
+
+// like make_riovec, but leaves the file to be opened by the ring
+int stat_riovec(const char *pathname, RIOVec *rd, BufArena *arena) {
+    rd->pathname = pathname;
+    rd->fd = -1;
+    rd->dio_align = 0;
+    struct stat st;
+    if (stat(pathname, &st)) {
+        perror("stat");
+        return 1;
+    }
+    return alloc_riovec(rd, st.st_size, arena, numa_placement ? device_node(st.st_dev) : -1);
+}
+
+// safe to call again, fOutBytes and fSize are kept for reporting
+void free_riovec(RIOVec *io) {
+    if (io->fd >= 0) {
+        close(io->fd);
+        io->fd = -1;
+    }
+    // arena memory goes with the arena, the segment is only told
+    if (io->arena) {
+        arena_put(io->arena, io->buf_index);
+    } else if (io->mapped) {
+        munmap(io->fBuffer, io->fSize);
+    } else if (io->map_len) {
+        munmap(io->fBuffer, io->map_len);
+    } else if (io->slab) {
+        drop_slab(io->slab);
+    } else if (NULL != io->fBuffer && io->buf_index < 0) {
+        free(io->fBuffer);
+    }
+    io->fBuffer = NULL;
+    io->mapped = 0;
+    io->map_len = 0;
+    io->slab = NULL;
+    io->buf_index = -1;
+    io->arena = NULL;
+    budget_credit(io);
+    for (unsigned i = 0; i < io->nchain; i++) {
+        free(io->chain[i].iov_base);
+    }
+    free(io->chain);
+    free(io->ranges);
+    free(io->reads);
+    free(io->staged);
+    io->chain = NULL;
+    io->nchain = 0;
+    io->ranges = NULL;
+    io->nranges = 0;
+    io->reads = NULL;
+    io->staged = NULL;
+}
+
+// a file has been read and reported: hand it to the consumer, or under -M
+// release it, nothing else would
+void deliver_file(RIOVec *f, int index, const ReadOptions *opts) {
+    if (opts->on_ready) {
+        opts->on_ready(f, index, opts->ready_arg);
+    } else if (buffer_budget) {
+        free_riovec(f);
+    }
+}
+
+// a list of files that is complete from the start
+void file_list_init(FileList *list, RIOVec *files, int count) {
+    memset(list, 0, sizeof(*list));
+    list->files = files;
+    list->count = count;
+    list->done = 1;
+    pthread_mutex_init(&list->lock, NULL);
+    pthread_cond_init(&list->grown, NULL);
+}
+
+// an empty list to be filled with file_list_slot/file_list_push while the
+// engine runs; the address space is reserved but only committed as it fills,
+// so files never has to move under readers
+int file_list_reserve(FileList *list, int max_files) {
+    memset(list, 0, sizeof(*list));
+    void *addr = mmap(NULL, (size_t)max_files * sizeof(RIOVec), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    list->files = addr;
+    list->max_files = max_files;
+    pthread_mutex_init(&list->lock, NULL);
+    pthread_cond_init(&list->grown, NULL);
+    return 0;
+}
+
+// the zeroed entry the next file_list_push publishes, NULL when the list is
+// full; only the single producer calls this
+RIOVec *file_list_slot(FileList *list) {
+    int index = list->count;
+    if (index == list->max_files) {
+        return NULL;
+    }
+    if (index == list->committed) {
+        int step = list->max_files - index < FILE_LIST_STEP ? list->max_files - index : FILE_LIST_STEP;
+        if (mprotect(list->files + index, (size_t)step * sizeof(RIOVec), PROT_READ | PROT_WRITE)) {
+            perror("mprotect");
+            return NULL;
+        }
+        list->committed += step;
+    }
+    return &list->files[index];
+}
+
+void file_list_push(FileList *list) {
+    pthread_mutex_lock(&list->lock);
+    __atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&list->grown);
+    pthread_mutex_unlock(&list->lock);
+}
+
+void file_list_end(FileList *list) {
+    pthread_mutex_lock(&list->lock);
+    __atomic_store_n(&list->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&list->grown);
+    pthread_mutex_unlock(&list->lock);
+}
+
+// 1 once files[index] is filled in, 0 if the list ended before it; without
+// block, -1 if it may still come instead of waiting for it
+int file_list_get(FileList *list, int index, int block) {
+    // done first: once it is set, count is final
+    int done = __atomic_load_n(&list->done, __ATOMIC_ACQUIRE);
+    if (index < __atomic_load_n(&list->count, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    if (done) {
+        return 0;
+    }
+    if (!block) {
+        return -1;
+    }
+    pthread_mutex_lock(&list->lock);
+    while (index >= list->count && !list->done) {
+        pthread_cond_wait(&list->grown, &list->lock);
+    }
+    int ret = index < list->count;
+    pthread_mutex_unlock(&list->lock);
+    return ret;
+}
+
+// after free_riovec on every file; reserved lists own their pathnames
+void file_list_free(FileList *list) {
+    if (list->max_files) {
+        for (int i = 0; i < list->count; i++) {
+            free((char *)list->files[i].pathname);
+        }
+        munmap(list->files, (size_t)list->max_files * sizeof(RIOVec));
+    }
+    pthread_cond_destroy(&list->grown);
+    pthread_mutex_destroy(&list->lock);
+}
+
+// command line numbers, shared by read_files and the bench
+int parse_uint(const char *arg, unsigned long max, unsigned *out) {
+    char *end;
+    unsigned long val = strtoul(arg, &end, 10);
+    if (end == arg || *end || val > max) {
+        return 1;
+    }
+    *out = (unsigned)val;
+    return 0;
+}
+
+// parse a byte count with an optional K/M/G suffix
+int parse_size(const char *arg, size_t *out) {
+    char *end;
+    unsigned long long val = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': val <<= 10; /* fallthrough */
+    case 'M': case 'm': val <<= 10; /* fallthrough */
+    case 'K': case 'k': val <<= 10; end++; break;
+    }
+    if (end == arg || *end) {
+        return 1;
+    }
+    *out = (size_t)val;
+    return 0;
+}
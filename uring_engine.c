@@ -0,0 +1,1362 @@
+#define _GNU_SOURCE // struct statx, preadv2
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "liburing.h"
+#include "liburing/io_uring.h"
+
+#include "read_files.h"
+
+/*
+ * io_uring engine
+ *
+ * -- Steps --
+ * 1. Create the ring
+ * 2. Check whether non-vectored read is supported using io_uring_probe
+ * 3. If so, submit read(v) operations
+ * 4. Reap read-completed completion queue entries
+ * 5. Tear-down
+ *
+ * Steps 3 and 4 run as a sliding window: at most `depth` reads are in flight,
+ * and each reaped completion frees a slot for the next file. The ring is sized
+ * to the window, not to the number of files.
+ *
+ * Files larger than the chunk size are split into independent chunk reads
+ * that share the window. A short completion is resubmitted from where it
+ * stopped, so a file is only done once fOutBytes == fSize (or EOF is hit).
+ *
+ * With -F, file buffers are carved out of an arena registered once with the
+ * ring and read with IORING_OP_READ_FIXED, so the kernel does not have to pin
+ * and unpin user pages on every read.
+ *
+ * With -f, files are opened by the ring straight into a sparse registered
+ * file table (direct descriptors), read with IOSQE_FIXED_FILE and closed in
+ * the ring, so no op touches the process fd table.
+ *
+ * With -a, nothing is opened or stat'ed up front: each file goes through a
+ * linked IORING_OP_OPENAT -> IORING_OP_STATX pair, its buffer is allocated
+ * when the statx completes, then its chunks are read and IORING_OP_CLOSE
+ * retires it. Metadata lookups overlap with data reads of other files.
+ *
+ * With -s, the ring is created with IORING_SETUP_SQPOLL so a kernel thread
+ * picks up submissions without io_uring_enter. io_uring_submit still enters
+ * the kernel when the thread has gone idle and needs a wakeup; those are
+ * counted and reported. -C pins the thread to a cpu (IORING_SETUP_SQ_AFF).
+ *
+ * With -D, files are opened O_DIRECT and the ring is created with
+ * IORING_SETUP_IOPOLL, so completions are polled from the device instead of
+ * waiting on interrupts. Buffers and chunks are aligned to the file's
+ * direct I/O alignment; the unaligned tail of a file is read as one aligned
+ * block into a per-slot bounce buffer and copied out. Devices without poll
+ * queues fail polled reads, so the probe tries one on the first file and the
+ * engine is passed over there.
+ *
+ * Each round submits and waits for up to -b completions in one
+ * io_uring_submit_and_wait, then drains every available cqe in a single pass
+ * and advances the cq head once.
+ *
+ * With -B, sizes are not trusted at all: reads use IOSQE_BUFFER_SELECT on a
+ * registered provided-buffer ring and each file keeps reading at its current
+ * position until EOF, chaining the buffers the kernel picked. This works for
+ * procfs/sysfs files, pipes and files that are still growing.
+ *
+ * With -w, the files are split into contiguous blocks over that many worker
+ * threads, each pinned to its own cpu and driving its own ring, window (-d
+ * is per worker) and arena slice. A worker that runs out of files steals
+ * the back half of the busiest worker's remaining block, so a few slow
+ * files do not leave the other cores idle. Files still being listed when
+ * the engine starts (-i) are claimed one at a time by whichever worker has
+ * room, and a worker only waits for them once its window is empty.
+ *
+ * With -n, workers are dealt out over the NUMA nodes, each pinned to a cpu
+ * of its node with its arena slice bound there; every node with cpus we may
+ * use gets at least one, even if -w asked for fewer. Files known up front
+ * are grouped by the node of their device and handed to that node's
+ * workers, which also steal from each other before stealing across nodes.
+ *
+ * Buffered reads that cannot be served from the page cache are punted to
+ * io-wq kernel workers. -W creates the first ring up front and attaches the
+ * others to it (IORING_SETUP_ATTACH_WQ); io-wq belongs to the submitting
+ * task on current kernels, so this shares one pool only together with -s,
+ * where a single sq thread then submits for every ring. -m caps the bounded
+ * (regular file) and unbounded (socket, pipe) workers with
+ * io_uring_register_iowq_max_workers, on every ring so the total stays at
+ * most workers times the cap.
+ *
+ * With -H, each file opened on admission is first checked for page cache
+ * residency (cachestat, or mincore on older kernels). A fully cached file is
+ * read right away with preadv2(RWF_NOWAIT), which costs less than an sqe and
+ * a cqe and can never be punted to io-wq; whatever would block after all
+ * goes through the ring like a cold file.
+ *
+ * With -N, every read is first submitted with RWF_NOWAIT: cached data
+ * completes inline during submission, and a read that would block comes back
+ * -EAGAIN from reap_reads and is resubmitted as a normal read (with
+ * IOSQE_ASYNC under -A, straight to io-wq instead of another inline try).
+ * Short reads resume without RWF_NOWAIT, since the rest was not cached.
+ *
+ * Finished files are handed to the consumer (ReadOptions.on_ready) after
+ * the slots they freed have been refilled and submitted, so the ring keeps
+ * reading while the callbacks run.
+ *
+ * With -S (one-shot scans), reads carry RWF_DONTCACHE so the kernel drops
+ * their pages once copied out. Kernels or filesystems without it fail the
+ * read with -EOPNOTSUPP; the window then switches to following every chunk
+ * with an IORING_OP_FADVISE(POSIX_FADV_DONTNEED) on the slot that read it.
+ *
+ */
+
+#define BUF_GROUP 0
+
+#ifndef RWF_DONTCACHE
+#define RWF_DONTCACHE 0x00000080
+#endif
+
+// provided buffer ring for -B, one buffer per bid
+typedef struct BufRing {
+    struct io_uring_buf_ring *br;
+    char **bufs;        // buffer currently handed to the kernel under each bid
+    unsigned entries;
+    unsigned buf_size;
+} BufRing;
+
+// give the kernel a buffer under bid
+static void buf_ring_put(BufRing *b, unsigned bid, char *buf) {
+    b->bufs[bid] = buf;
+    io_uring_buf_ring_add(b->br, buf, b->buf_size, bid, io_uring_buf_ring_mask(b->entries), 0);
+    io_uring_buf_ring_advance(b->br, 1);
+}
+
+static int init_buf_ring(struct io_uring *ring, BufRing *b, unsigned entries, unsigned buf_size) {
+    int ret;
+    b->entries = entries;
+    b->buf_size = buf_size;
+    b->bufs = calloc(entries, sizeof(char *));
+    if (!b->bufs) {
+        perror("calloc");
+        return 1;
+    }
+    b->br = io_uring_setup_buf_ring(ring, entries, BUF_GROUP, 0, &ret);
+    if (!b->br) {
+        fprintf(stderr, "buffer ring setup failed: %s\n", strerror(-ret));
+        return 1;
+    }
+    for (unsigned bid = 0; bid < entries; bid++) {
+        char *buf = malloc(buf_size);
+        if (!buf) {
+            perror("malloc");
+            return 1;
+        }
+        buf_ring_put(b, bid, buf);
+    }
+    return 0;
+}
+
+static void free_buf_ring(struct io_uring *ring, BufRing *b) {
+    io_uring_free_buf_ring(ring, b->br, b->entries, BUF_GROUP);
+    for (unsigned bid = 0; bid < b->entries; bid++) {
+        free(b->bufs[bid]);
+    }
+    free(b->bufs);
+}
+
+enum { OP_OPEN, OP_STATX, OP_READ, OP_CLOSE, OP_FADVISE };
+static const char *op_names[] = { "open", "statx", "read", "close", "fadvise" };
+
+// one op in flight, sqe->user_data is its index in ReadWindow.ops
+typedef struct RingOp {
+    int kind;           // OP_*
+    int file;           // index into files array
+    off_t offset;       // file offset still to read
+    size_t len;         // bytes still to read
+    void *dest;         // where they go
+    int bounce;         // O_DIRECT tail, read through the slot's bounce buffer
+    int nowait;         // this attempt carries RWF_NOWAIT (-N)
+    int dontcache;      // this attempt carries RWF_DONTCACHE (-S)
+    size_t done;        // read by earlier attempts of this chunk
+    unsigned long long start_ns; // read prepped, kept across short-read resubmits
+} RingOp;
+
+// submission window over the files array
+typedef struct ReadWindow {
+    unsigned depth;     // max ops in flight
+    size_t chunk_size;
+    BufArena *arena;    // registered buffers, NULL unless -F
+    int fixed_files;    // open into the registered file table (-f)
+    int async_meta;     // open and statx in the ring (-a)
+    int direct;         // O_DIRECT reads on an IOPOLL ring (-D)
+    int hybrid;         // read cached files inline (-H)
+    int nowait;         // first attempt of every read with RWF_NOWAIT (-N)
+    int retry_async;    // -EAGAIN retries with IOSQE_ASYNC (-A)
+    unsigned nowait_hits; // reads completed by the RWF_NOWAIT attempt
+    unsigned nowait_retries;
+    int dontcache;      // reads with RWF_DONTCACHE (-S)
+    int drop_behind;    // -S without RWF_DONTCACHE: fadvise each chunk away
+    unsigned inline_files; // files -H finished without the ring
+    size_t inline_bytes;
+    char *bounce;       // DIO_BOUNCE_SIZE per slot, only with direct
+    BufRing *buf_ring;  // provided buffers, NULL unless -B
+    RingOp *ops;        // depth slots
+    struct statx *stx;  // statx result per slot, only with async_meta
+    unsigned *free_ops; // stack of unused slots
+    unsigned nfree;
+    unsigned *pending;  // fifo of slots waiting for an sqe, kept in
+    unsigned pending_head; // submission order so linked ops stay adjacent
+    unsigned npending;
+    int ready_head;     // files with chunks left to queue, linked by next_ready
+    int ready_tail;
+    int done_head;      // finished files not handed over yet, same link
+    int done_tail;
+    LatencyHist *lat;   // per worker, merged into read_latency at the end
+    int completed;
+    int submitted;
+} ReadWindow;
+
+// one ring and its window, driven by one thread
+typedef struct Shard {
+    struct io_uring ring;
+    int ring_ready;     // torn down by uring_release
+    int set_up;         // setup_shard done
+    BufArena arena;
+    size_t arena_size;
+    BufRing buf_ring;
+    ReadWindow win;
+    LatencyHist lat;
+    pthread_mutex_t lock; // next and end, thieves take it too
+    int next;           // files [next, end) are not admitted yet, positions
+    int end;            // in file_order with -n
+    int cpu;            // pinned to this cpu, -1 for the calling thread
+    int node;           // NUMA node of that cpu with -n, else -1
+    pthread_t thread;
+    unsigned submits;
+    unsigned sq_wakeups;
+    unsigned steals;
+    int failed;
+} Shard;
+
+static Shard *shards;
+static unsigned nshards;
+static int stop_shards; // a worker failed, the others give up
+static FileList *file_list;
+static int *file_order; // with -n, files grouped by the node of their shards
+static pthread_mutex_t listed_lock = PTHREAD_MUTEX_INITIALIZER;
+static int listed_next; // files listed after the blocks were split, not admitted yet
+
+static int init_window(ReadWindow *win, unsigned depth, size_t chunk_size) {
+    memset(win, 0, sizeof(*win));
+    win->depth = depth;
+    win->chunk_size = chunk_size;
+    win->ops = calloc(depth, sizeof(RingOp));
+    win->free_ops = calloc(depth, sizeof(unsigned));
+    win->pending = calloc(depth, sizeof(unsigned));
+    win->stx = calloc(depth, sizeof(struct statx));
+    if (!win->ops || !win->free_ops || !win->pending || !win->stx) {
+        perror("calloc");
+        return 1;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        win->free_ops[i] = depth - 1 - i;
+    }
+    win->nfree = depth;
+    win->ready_head = win->ready_tail = -1;
+    win->done_head = win->done_tail = -1;
+    return 0;
+}
+
+static void free_window(ReadWindow *win) {
+    free(win->ops);
+    free(win->free_ops);
+    free(win->pending);
+    free(win->stx);
+    free(win->bounce);
+}
+
+static void push_pending(ReadWindow *win, unsigned slot) {
+    win->pending[(win->pending_head + win->npending++) % win->depth] = slot;
+}
+
+static unsigned pop_pending(ReadWindow *win) {
+    unsigned slot = win->pending[win->pending_head];
+    win->pending_head = (win->pending_head + 1) % win->depth;
+    win->npending--;
+    return slot;
+}
+
+// claim a slot for a new op and queue it for submission
+static RingOp *take_op(ReadWindow *win, int kind, int file) {
+    unsigned slot = win->free_ops[--win->nfree];
+    RingOp *op = &win->ops[slot];
+    op->kind = kind;
+    op->file = file;
+    op->bounce = 0;
+    op->nowait = win->nowait;
+    op->done = 0;
+    push_pending(win, slot);
+    return op;
+}
+
+static void release_op(ReadWindow *win, unsigned slot) {
+    win->free_ops[win->nfree++] = slot;
+}
+
+static void push_ready(RIOVec files[], ReadWindow *win, int index) {
+    files[index].next_ready = -1;
+    if (win->ready_tail >= 0) {
+        files[win->ready_tail].next_ready = index;
+    } else {
+        win->ready_head = index;
+    }
+    win->ready_tail = index;
+}
+
+static void pop_ready(RIOVec files[], ReadWindow *win) {
+    win->ready_head = files[win->ready_head].next_ready;
+    if (win->ready_head < 0) {
+        win->ready_tail = -1;
+    }
+}
+
+static void queue_op(struct io_uring_sqe *sqe, RIOVec files[], ReadWindow *win, unsigned slot) {
+    RingOp *op = &win->ops[slot];
+    RIOVec *f = &files[op->file];
+    switch (op->kind) {
+    case OP_OPEN:
+        if (win->fixed_files) {
+            io_uring_prep_openat_direct(sqe, AT_FDCWD, f->pathname, O_RDONLY, 0, IORING_FILE_INDEX_ALLOC);
+        } else {
+            io_uring_prep_openat(sqe, AT_FDCWD, f->pathname, O_RDONLY, 0);
+        }
+        if (win->async_meta) {
+            // statx is queued right behind and only runs if the open succeeded
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        break;
+    case OP_STATX:
+        io_uring_prep_statx(sqe, AT_FDCWD, f->pathname, 0, STATX_SIZE, &win->stx[slot]);
+        break;
+    case OP_READ:
+        if (win->buf_ring) {
+            // the kernel picks the buffer, -1 reads at the file position
+            // so pipes and other unseekable files work too
+            io_uring_prep_read(sqe, f->fd, NULL, win->buf_ring->buf_size, -1);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = BUF_GROUP;
+        } else if (op->bounce) {
+            // a whole aligned block, the read comes back short at EOF
+            io_uring_prep_read(sqe, f->fd, win->bounce + (size_t)slot * DIO_BOUNCE_SIZE,
+                f->dio_align, op->offset);
+        } else if (f->buf_index >= 0) {
+            io_uring_prep_read_fixed(sqe, f->fd, op->dest, op->len, op->offset, f->buf_index);
+        } else {
+            io_uring_prep_read(sqe, f->fd, op->dest, op->len, op->offset);
+        }
+        if (win->fixed_files) {
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+        op->dontcache = win->dontcache;
+        sqe->rw_flags = (op->nowait ? RWF_NOWAIT : 0) | (op->dontcache ? RWF_DONTCACHE : 0);
+        if (!op->nowait && win->nowait && win->retry_async) {
+            sqe->flags |= IOSQE_ASYNC;
+        }
+        break;
+    case OP_FADVISE:
+        io_uring_prep_fadvise(sqe, f->fd, op->offset, op->len, POSIX_FADV_DONTNEED);
+        if (win->fixed_files) {
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+        break;
+    case OP_CLOSE:
+        if (win->fixed_files) {
+            io_uring_prep_close_direct(sqe, f->fd);
+        } else {
+            io_uring_prep_close(sqe, f->fd);
+        }
+        break;
+    }
+
+    // mark position in ops array
+    sqe->user_data = slot;
+}
+
+static void finish_file(RIOVec files[], int index, ReadWindow *win) {
+    scatter_ranges(&files[index]);
+    printf("read %lu bytes from file %d\n", files[index].fOutBytes, index);
+
+    // fd is no longer needed once all its reads have landed, unless the
+    // ring already closed it
+    if (files[index].fd >= 0) {
+        close(files[index].fd);
+    }
+    files[index].fd = -1;
+    win->completed++;
+    // handed over once the ring has been refilled, see drive_shard
+    files[index].next_ready = -1;
+    if (win->done_tail >= 0) {
+        files[win->done_tail].next_ready = index;
+    } else {
+        win->done_head = index;
+    }
+    win->done_tail = index;
+}
+
+static void deliver_files(RIOVec files[], ReadWindow *win, const ReadOptions *opts) {
+    while (win->done_head >= 0) {
+        int index = win->done_head;
+        win->done_head = files[index].next_ready;
+        deliver_file(&files[index], index, opts);
+    }
+    win->done_tail = -1;
+}
+
+// a hot file: read what the page cache has without blocking, the rest is
+// left queued for the ring
+static void read_cached(RIOVec *f, ReadWindow *win) {
+    while (f->queued < f->fSize) {
+        struct iovec iov = { (char *)f->fBuffer + f->queued, f->fSize - f->queued };
+        unsigned long long start = now_ns();
+        ssize_t n = preadv2(f->fd, &iov, 1, f->fOffset + f->queued, RWF_NOWAIT);
+        if (n <= 0) {
+            break;
+        }
+        latency_record(win->lat, f->fSize, now_ns() - start);
+        f->queued += n;
+        f->fOutBytes += n;
+        win->inline_bytes += n;
+    }
+}
+
+// files are opened on admission so open files stay bounded by depth
+static int admit_file(RIOVec files[], int index, ReadWindow *win) {
+    RIOVec *f = &files[index];
+    if (win->buf_ring) {
+        // size is whatever the reads return before EOF
+        f->fBuffer = NULL;
+        f->fOffset = 0;
+        f->fSize = 0;
+        f->fOutBytes = 0;
+        f->queued = 0;
+        f->inflight = 0;
+        f->dio_align = 0;
+        if (win->fixed_files) {
+            take_op(win, OP_OPEN, index);
+            return 0;
+        }
+        f->fd = open(f->pathname, O_RDONLY);
+        if (f->fd < 0) {
+            perror("open");
+            fprintf(stderr, "initialization failed for file[%d] (%s)\n", index, f->pathname);
+            return 1;
+        }
+        push_ready(files, win, index);
+        return 0;
+    }
+    if (win->async_meta) {
+        // size and buffer are filled in when the statx completes
+        f->fd = -1;
+        take_op(win, OP_OPEN, index);
+        take_op(win, OP_STATX, index);
+        return 0;
+    }
+    if (win->fixed_files) {
+        if (stat_riovec(f->pathname, f, win->arena)) {
+            fprintf(stderr, "initialization failed for file[%d] (%s)\n", index, f->pathname);
+            return 1;
+        }
+        if (f->fSize == 0) {
+            finish_file(files, index, win);
+        } else {
+            // the direct descriptor comes back in the open cqe
+            take_op(win, OP_OPEN, index);
+        }
+        return 0;
+    }
+
+    if (make_riovec(f->pathname, f, win->arena, win->direct)) {
+        fprintf(stderr, "initialization failed for file[%d] (%s)\n", index, f->pathname);
+        return 1;
+    }
+    // ranges read only parts of the file, residency of the whole says little
+    if (win->hybrid && f->fSize && !f->nranges && cache_resident(f->fd, f->fSize)) {
+        read_cached(f, win);
+        win->inline_files += f->queued == f->fSize;
+    }
+    if (f->queued == f->fSize) {
+        finish_file(files, index, win);
+    } else {
+        push_ready(files, win, index);
+    }
+    return 0;
+}
+
+// split the next chunk off the head of the ready list
+static void queue_chunk(RIOVec files[], ReadWindow *win) {
+    int i = win->ready_head;
+    RIOVec *f = &files[i];
+    RingOp *op = take_op(win, OP_READ, i);
+    op->start_ns = now_ns();
+    if (win->buf_ring) {
+        // one read at a time, the file goes back on the list when it lands
+        op->offset = f->queued;
+        op->len = win->buf_ring->buf_size;
+        f->inflight++;
+        pop_ready(files, win);
+        return;
+    }
+    op->len = next_piece(f, win->chunk_size, &op->offset, &op->dest, &op->bounce);
+    f->inflight++;
+    if (f->queued == f->fSize) {
+        pop_ready(files, win);
+    }
+}
+
+// next file listed while the engine runs, -1 when the list has ended, -2
+// when the next one is not listed yet and block is not set
+static int claim_listed(int block) {
+    for (;;) {
+        pthread_mutex_lock(&listed_lock);
+        int index = listed_next;
+        int more = file_list_get(file_list, index, 0);
+        if (more > 0) {
+            listed_next++;
+        }
+        pthread_mutex_unlock(&listed_lock);
+        if (more > 0) {
+            return index;
+        }
+        if (more == 0) {
+            return -1;
+        }
+        if (!block) {
+            return -2;
+        }
+        // another shard may take it first, then wait for the one after
+        file_list_get(file_list, index, 1);
+    }
+}
+
+// next file for this shard to admit, stolen from the busiest shard once its
+// own block is used up, then taken from the files still being listed; -1
+// when there is nothing left anywhere, -2 when that has to wait and block
+// is not set
+static int claim_file(Shard *s, int block) {
+    int index = -1;
+    pthread_mutex_lock(&s->lock);
+    if (s->next < s->end) {
+        index = s->next++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    while (index < 0) {
+        // a shard on the same node first, only then one across the interconnect
+        Shard *victim = NULL;
+        int most = 0, near = 0;
+        for (unsigned i = 0; i < nshards; i++) {
+            pthread_mutex_lock(&shards[i].lock);
+            int left = shards[i].end - shards[i].next;
+            pthread_mutex_unlock(&shards[i].lock);
+            int same = shards[i].node == s->node;
+            if (left > 0 && (same > near || (same == near && left > most))) {
+                most = left;
+                near = same;
+                victim = &shards[i];
+            }
+        }
+        if (!victim) {
+            return claim_listed(block);
+        }
+        // never hold two locks, recheck in case someone else got there first
+        int start = -1, end = 0;
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->next;
+        if (left > 0) {
+            end = victim->end;
+            start = victim->end = end - (left + 1) / 2;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (start < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        s->next = start + 1;
+        s->end = end;
+        s->steals++;
+        pthread_mutex_unlock(&s->lock);
+        index = start;
+    }
+    return file_order ? file_order[index] : index;
+}
+
+// fill the window: pending ops first, then chunks of opened files, then new files
+static int prep_reads(Shard *s, RIOVec files[], const ReadOptions *opts) {
+    struct io_uring *ring = &s->ring;
+    ReadWindow *win = &s->win;
+    struct io_uring_sqe *sqe;
+    for (;;) {
+        if (win->npending) {
+            sqe = io_uring_get_sqe(ring);
+            if (!sqe) {
+                // ring is sized to the window, so this only happens if the
+                // kernel has not consumed earlier submissions yet
+                break;
+            }
+            queue_op(sqe, files, win, pop_pending(win));
+            win->submitted++;
+            continue;
+        }
+        if (!win->nfree) {
+            break;
+        }
+        if (win->ready_head >= 0) {
+            queue_chunk(files, win);
+            continue;
+        }
+        if (win->async_meta && win->nfree < 2) {
+            break;
+        }
+        // only wait for a release under -M or for files still to be listed
+        // with nothing in flight, and hand over what is done before that,
+        // since it may be what both are waiting on
+        int idle = win->nfree == win->depth;
+        if (idle) {
+            deliver_files(files, win, opts);
+        }
+        if (!budget_room(idle)) {
+            break;
+        }
+        int index = claim_file(s, idle);
+        if (index < 0) {
+            break;
+        }
+        if (admit_file(files, index, win)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// a file's last op is done: close it in the ring reusing the slot, or finish now
+static void retire_file(RIOVec files[], ReadWindow *win, unsigned slot) {
+    RingOp *op = &win->ops[slot];
+    if (win->fixed_files || win->async_meta) {
+        op->kind = OP_CLOSE;
+        push_pending(win, slot);
+    } else {
+        release_op(win, slot);
+        finish_file(files, op->file, win);
+    }
+}
+
+// the slot's chunk is done with: free the slot, or retire the file on its last one
+static void complete_chunk(RIOVec files[], ReadWindow *win, unsigned slot) {
+    RIOVec *f = &files[win->ops[slot].file];
+    f->inflight--;
+    if (f->inflight || f->queued != f->fSize) {
+        release_op(win, slot);
+    } else {
+        retire_file(files, win, slot);
+    }
+}
+
+static void complete_read(RIOVec files[], ReadWindow *win, unsigned slot, size_t res) {
+    RingOp *op = &win->ops[slot];
+    RIOVec *f = &files[op->file];
+    if (op->bounce) {
+        if (res > op->len) {
+            res = op->len;
+        }
+        memcpy(op->dest, win->bounce + (size_t)slot * DIO_BOUNCE_SIZE, res);
+    }
+    f->fOutBytes += res;
+
+    // a short bounced read can't be resumed at an unaligned offset
+    if (res > 0 && res < op->len && !op->bounce) {
+        // short read, pick up where the kernel stopped
+        op->offset += res;
+        op->len -= res;
+        op->dest = (char *)op->dest + res;
+        op->nowait = 0;
+        op->done += res;
+        push_pending(win, slot);
+        return;
+    }
+    if (res < op->len) {
+        fprintf(stderr, "file[%d] ended early at %lu of %lu bytes\n",
+            op->file, f->fOutBytes, f->fSize);
+    }
+    latency_record(win->lat, f->fSize, now_ns() - op->start_ns);
+    if (win->drop_behind) {
+        // the chunk still counts as in flight, so the file can't be closed
+        // under the fadvise
+        op->kind = OP_FADVISE;
+        op->offset -= op->done;
+        op->len = op->done + res;
+        push_pending(win, slot);
+        return;
+    }
+    complete_chunk(files, win, slot);
+}
+
+// a provided-buffer read landed: keep the buffer and read on, or stop at EOF
+static int complete_select(RIOVec files[], ReadWindow *win, unsigned slot, size_t res, unsigned cqe_flags) {
+    RingOp *op = &win->ops[slot];
+    RIOVec *f = &files[op->file];
+    BufRing *b = win->buf_ring;
+    unsigned bid = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+    // the size is not known up front, bucket by what has been read so far
+    latency_record(win->lat, f->fOutBytes + res, now_ns() - op->start_ns);
+    f->inflight--;
+
+    if (res == 0) {
+        // an empty read may still have consumed a buffer, recycle it
+        if (cqe_flags & IORING_CQE_F_BUFFER) {
+            buf_ring_put(b, bid, b->bufs[bid]);
+        }
+        if (join_chain(f)) {
+            return 1;
+        }
+        retire_file(files, win, slot);
+        return 0;
+    }
+
+    // the file keeps the filled buffer, the kernel gets a fresh one
+    char *fresh = malloc(b->buf_size);
+    if (!fresh) {
+        perror("malloc");
+        return 1;
+    }
+    if (append_chain(f, b->bufs[bid], res)) {
+        return 1;
+    }
+    buf_ring_put(b, bid, fresh);
+    f->fOutBytes += res;
+    f->queued += res;
+    release_op(win, slot);
+    push_ready(files, win, op->file);
+    return 0;
+}
+
+// the file is open and its size is known, size its buffer and start reading
+static int complete_statx(RIOVec files[], ReadWindow *win, unsigned slot) {
+    RingOp *op = &win->ops[slot];
+    RIOVec *f = &files[op->file];
+    int node = numa_placement ? device_node(makedev(win->stx[slot].stx_dev_major, win->stx[slot].stx_dev_minor)) : -1;
+    if (alloc_riovec(f, win->stx[slot].stx_size, win->arena, node)) {
+        fprintf(stderr, "initialization failed for file[%d] (%s)\n", op->file, f->pathname);
+        return 1;
+    }
+    if (f->fSize == 0) {
+        retire_file(files, win, slot);
+    } else {
+        release_op(win, slot);
+        push_ready(files, win, op->file);
+    }
+    return 0;
+}
+
+// retire every completion already in the cq ring, then advance it once
+static int reap_reads(struct io_uring *ring, RIOVec files[], ReadWindow *win) {
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned seen = 0;
+
+    io_uring_for_each_cqe(ring, head, cqe) {
+        seen++;
+        unsigned long slot = (unsigned long) io_uring_cqe_get_data(cqe);
+        if (slot >= win->depth) {
+            fprintf(stderr, "bad cqe user_data: %lu\n", slot);
+            return 1;
+        }
+        RingOp *op = &win->ops[slot];
+        RIOVec *f = &files[op->file];
+        if (cqe->res == -EAGAIN && op->kind == OP_READ && op->nowait) {
+            // not cached, go again the normal way
+            op->nowait = 0;
+            win->nowait_retries++;
+            push_pending(win, slot);
+            continue;
+        }
+        if (cqe->res == -EOPNOTSUPP && op->kind == OP_READ && op->dontcache) {
+            // no uncached buffered reads here, drop pages by hand instead
+            if (win->dontcache) {
+                fprintf(stderr, "RWF_DONTCACHE not supported, dropping pages with fadvise\n");
+            }
+            win->dontcache = 0;
+            win->drop_behind = 1;
+            push_pending(win, slot);
+            continue;
+        }
+        if (op->kind == OP_FADVISE) {
+            // only advice, a failure leaves the pages cached but the data is read
+            complete_chunk(files, win, slot);
+            continue;
+        }
+        if (cqe->res < 0) {
+            fprintf(stderr, "%s file[%d] (%s) failed: %s\n",
+                op_names[op->kind], op->file, f->pathname, strerror(-cqe->res));
+            if (win->buf_ring && cqe->res == -ENOBUFS) {
+                fprintf(stderr, "provided buffer ring ran dry\n");
+            }
+            if (win->direct && cqe->res == -EOPNOTSUPP) {
+                fprintf(stderr, "polled I/O needs a device with poll queues (e.g. nvme.poll_queues)\n");
+            }
+            return 1;
+        }
+        if (op->kind == OP_READ && op->nowait) {
+            win->nowait_hits++;
+        }
+        int res = cqe->res;
+
+        switch (op->kind) {
+        case OP_OPEN:
+            f->fd = res; // index in the registered file table with -f
+            release_op(win, slot);
+            if (!win->async_meta) {
+                push_ready(files, win, op->file);
+            }
+            break;
+        case OP_STATX:
+            if (complete_statx(files, win, slot)) {
+                return 1;
+            }
+            break;
+        case OP_READ:
+            if (!win->buf_ring) {
+                complete_read(files, win, slot, (size_t)res);
+            } else if (complete_select(files, win, slot, (size_t)res, cqe->flags)) {
+                return 1;
+            }
+            break;
+        case OP_CLOSE:
+            f->fd = -1;
+            release_op(win, slot);
+            finish_file(files, op->file, win);
+            break;
+        }
+    }
+
+    // advance ring
+    io_uring_cq_advance(ring, seen);
+    return 0;
+}
+
+// ring and the buffers registered with it, kept until uring_release since
+// file buffers may live in the arena
+// -EOPNOTSUPP when the file's device cannot complete polled reads (no poll
+// queues), 0 when it can or when it is not worth telling here
+static int try_polled_read(const char *pathname) {
+    int fd = open(pathname, O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+        // the run reports it
+        return 0;
+    }
+    struct io_uring ring;
+    if (io_uring_queue_init(1, &ring, IORING_SETUP_IOPOLL)) {
+        close(fd);
+        return -EOPNOTSUPP;
+    }
+    static char block[DIO_BOUNCE_SIZE] __attribute__((aligned(DIO_BOUNCE_SIZE)));
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_read(sqe, fd, block, sizeof(block), 0);
+    int ret = io_uring_submit(&ring);
+    struct io_uring_cqe *cqe;
+    if (ret == 1 && io_uring_wait_cqe(&ring, &cqe) == 0) {
+        ret = cqe->res == -EOPNOTSUPP ? -EOPNOTSUPP : 0;
+        io_uring_cqe_seen(&ring, cqe);
+    } else {
+        ret = 0;
+    }
+    io_uring_queue_exit(&ring);
+    close(fd);
+    return ret;
+}
+
+static int uring_probe(const ReadOptions *opts, const char *sample) {
+    struct io_uring probe_ring;
+    struct io_uring_probe *p;
+    if (io_uring_queue_init(1, &probe_ring, 0)) {
+        return 1;
+    }
+    // the ops setup_shard insists on for these options
+    p = io_uring_get_probe_ring(&probe_ring);
+    int ok = p && io_uring_opcode_supported(p, IORING_OP_READ);
+    if (ok && (opts->fixed_files || opts->async_meta)) {
+        ok = io_uring_opcode_supported(p, IORING_OP_OPENAT) && io_uring_opcode_supported(p, IORING_OP_CLOSE);
+    }
+    if (ok && opts->async_meta) {
+        ok = io_uring_opcode_supported(p, IORING_OP_STATX);
+    }
+    free(p);
+    io_uring_queue_exit(&probe_ring);
+    // -D runs on an IOPOLL ring, which only works if the device polls
+    if (ok && opts->direct && sample) {
+        ok = try_polled_read(sample) == 0;
+    }
+    return !ok;
+}
+
+// create the shard's ring, registrations and window
+static int setup_shard(Shard *s, const ReadOptions *opts) {
+    struct io_uring_probe *p;
+    int ret;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (opts->direct) {
+        params.flags |= IORING_SETUP_IOPOLL;
+    }
+    // the primary ring is set up before any worker starts
+    int primary = s == &shards[0];
+    if (opts->share_wq && !primary) {
+        params.flags |= IORING_SETUP_ATTACH_WQ;
+        params.wq_fd = shards[0].ring.ring_fd;
+    }
+    if (opts->sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = opts->sq_idle;
+        if (opts->sq_pin) {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = opts->sq_cpu;
+        }
+    }
+    ret = io_uring_queue_init_params(opts->depth, &s->ring, &params);
+    if (ret) {
+        fprintf(stderr, "ring create failed: %d\n", ret);
+        return 1;
+    }
+    s->ring_ready = 1;
+
+    // limits are kept per ring and applied to every task submitting to it
+    if (opts->iowq_max[0] || opts->iowq_max[1]) {
+        unsigned vals[2] = { opts->iowq_max[0], opts->iowq_max[1] };
+        ret = io_uring_register_iowq_max_workers(&s->ring, vals);
+        if (ret) {
+            fprintf(stderr, "io-wq worker limits failed: %s\n", strerror(-ret));
+            return 1;
+        }
+        if (primary) {
+            // the kernel hands back the previous limits
+            printf("io-wq workers capped at %u bounded, %u unbounded (were %u, %u)\n",
+                opts->iowq_max[0], opts->iowq_max[1], vals[0], vals[1]);
+        }
+    }
+
+    p = io_uring_get_probe_ring(&s->ring);
+    if (!p || !io_uring_opcode_supported(p, IORING_OP_READ)) {
+        fprintf(stderr, "read op not supported by kernel, exiting: %d\n", ret);
+        return 1;
+    }
+    if ((opts->fixed_files || opts->async_meta) && (!io_uring_opcode_supported(p, IORING_OP_OPENAT)
+            || !io_uring_opcode_supported(p, IORING_OP_CLOSE))) {
+        fprintf(stderr, "open/close ops not supported by kernel, exiting\n");
+        return 1;
+    }
+    if (opts->async_meta && !io_uring_opcode_supported(p, IORING_OP_STATX)) {
+        fprintf(stderr, "statx op not supported by kernel, exiting\n");
+        return 1;
+    }
+    free(p);
+
+    // every open file holds an op slot, so depth entries are enough
+    if (opts->fixed_files) {
+        ret = io_uring_register_files_sparse(&s->ring, opts->depth);
+        if (ret) {
+            // the table size is capped by RLIMIT_NOFILE
+            fprintf(stderr, "register files failed: %s\n", strerror(-ret));
+            return 1;
+        }
+    }
+
+    // each shard registers its own slice of the arena
+    s->arena_size = opts->arena_size / nshards;
+    if (s->arena_size) {
+        if (init_arena(&s->arena, s->arena_size, s->node)) {
+            return 1;
+        }
+        ret = io_uring_register_buffers(&s->ring, s->arena.segs, s->arena.nsegs);
+        if (ret) {
+            // pinned pages count against RLIMIT_MEMLOCK
+            fprintf(stderr, "register buffers failed: %s\n", strerror(-ret));
+            return 1;
+        }
+    }
+
+    // each op in flight holds at most one buffer, so one per slot never runs dry
+    if (opts->select_size) {
+        unsigned entries = 1;
+        while (entries < opts->depth) {
+            entries <<= 1;
+        }
+        if (!(s->ring.features & IORING_FEAT_RW_CUR_POS)) {
+            fprintf(stderr, "reads at the file position not supported by kernel, exiting\n");
+            return 1;
+        }
+        if (init_buf_ring(&s->ring, &s->buf_ring, entries, (unsigned)opts->select_size)) {
+            return 1;
+        }
+    }
+
+    ReadWindow *win = &s->win;
+    if (init_window(win, opts->depth, opts->chunk_size)) {
+        return 1;
+    }
+    win->arena = s->arena_size ? &s->arena : NULL;
+    win->fixed_files = opts->fixed_files;
+    win->async_meta = opts->async_meta;
+    win->direct = opts->direct;
+    win->hybrid = opts->hybrid;
+    win->nowait = opts->nowait;
+    win->retry_async = opts->retry_async;
+    win->dontcache = opts->scan;
+    win->buf_ring = opts->select_size ? &s->buf_ring : NULL;
+    win->lat = &s->lat;
+    if (opts->direct && posix_memalign((void **)&win->bounce, DIO_BOUNCE_SIZE, (size_t)opts->depth * DIO_BOUNCE_SIZE)) {
+        perror("posix_memalign");
+        return 1;
+    }
+    s->set_up = 1;
+    return 0;
+}
+
+// submit and reap until neither this shard nor any other has files left
+static int drive_shard(Shard *s, RIOVec files[], const ReadOptions *opts) {
+    ReadWindow *win = &s->win;
+    int ret;
+    while (!__atomic_load_n(&stop_shards, __ATOMIC_RELAXED)) {
+        ret = prep_reads(s, files, opts);
+        if (ret) {
+            fprintf(stderr, "prep reads failed: %d\n", ret);
+            return 1;
+        }
+        // nothing in flight after a prep means nothing was left to admit;
+        // empty files finish without touching the ring
+        if (win->nfree == win->depth) {
+            break;
+        }
+
+        // the sq thread only needs a kick once it has gone idle
+        if (opts->sqpoll && (IO_URING_READ_ONCE(*s->ring.sq.kflags) & IORING_SQ_NEED_WAKEUP)) {
+            s->sq_wakeups++;
+        }
+        // never wait for more completions than there are ops in flight
+        unsigned inflight = win->depth - win->nfree - win->npending;
+        ret = io_uring_submit_and_wait(&s->ring, opts->batch < inflight ? opts->batch : inflight);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "submit sqe failed: %d\n", ret);
+            return 1;
+        }
+        s->submits++;
+
+        ret = reap_reads(&s->ring, files, win);
+        if (ret) {
+            fprintf(stderr, "reap reads failed: %d\n", ret);
+            return 1;
+        }
+        // refill the ring before handing finished files over, so the
+        // consumer's work overlaps with the reads just queued
+        if (win->done_head >= 0 && opts->on_ready) {
+            ret = prep_reads(s, files, opts);
+            if (ret) {
+                fprintf(stderr, "prep reads failed: %d\n", ret);
+                return 1;
+            }
+            ret = io_uring_submit(&s->ring);
+            if (ret < 0 && ret != -EINTR) {
+                fprintf(stderr, "submit sqe failed: %d\n", ret);
+                return 1;
+            }
+            s->submits++;
+        }
+        deliver_files(files, win, opts);
+    }
+    // files that finished without the ring
+    deliver_files(files, win, opts);
+    return 0;
+}
+
+static int run_shard(Shard *s, RIOVec files[], const ReadOptions *opts) {
+    if ((!s->set_up && setup_shard(s, opts)) || drive_shard(s, files, opts)) {
+        __atomic_store_n(&stop_shards, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (opts->select_size) {
+        free_buf_ring(&s->ring, &s->buf_ring);
+    }
+    return 0;
+}
+
+typedef struct ShardArgs {
+    Shard *shard;
+    RIOVec *files;
+    const ReadOptions *opts;
+} ShardArgs;
+
+static void *shard_worker(void *arg) {
+    ShardArgs *a = arg;
+    Shard *s = a->shard;
+    // pin before submitting so io-wq workers forked for this thread start on
+    // this cpu too
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(s->cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        fprintf(stderr, "pin worker to cpu %d: %s\n", s->cpu, strerror(err));
+    }
+    s->failed = run_shard(s, a->files, a->opts);
+    return NULL;
+}
+
+// cpus of a NUMA node from sysfs, e.g. "0-15,32-47"; 1 if there is no such node
+static int node_cpus(int node, cpu_set_t *set) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 1;
+    }
+    CPU_ZERO(set);
+    int lo, hi;
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        if (fscanf(f, "-%d", &hi) != 1) {
+            hi = lo;
+        }
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (fgetc(f) != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// with -n, group the files known up front by the node of their device and
+// split each group over that node's shards; files with no known node, or on
+// a node without shards, are dealt out over all groups
+static int plan_nodes(RIOVec files[], int num_files) {
+    int shards_on[MAX_NUMA_NODES] = {0}, count[MAX_NUMA_NODES] = {0};
+    int used[MAX_NUMA_NODES], nused = 0;
+    for (unsigned i = 0; i < nshards; i++) {
+        if (shards_on[shards[i].node]++ == 0) {
+            used[nused++] = shards[i].node;
+        }
+    }
+    int *group = malloc((num_files ? num_files : 1) * sizeof(int));
+    file_order = malloc((num_files ? num_files : 1) * sizeof(int));
+    if (!group || !file_order) {
+        perror("malloc");
+        free(group);
+        return 1;
+    }
+    int spread = 0;
+    for (int i = 0; i < num_files; i++) {
+        int node = path_node(files[i].pathname);
+        if (node < 0 || !shards_on[node]) {
+            node = used[spread++ % nused];
+        }
+        group[i] = node;
+        count[node]++;
+    }
+    int start[MAX_NUMA_NODES], pos[MAX_NUMA_NODES], at = 0;
+    for (int n = 0; n < MAX_NUMA_NODES; n++) {
+        start[n] = pos[n] = at;
+        at += count[n];
+    }
+    for (int i = 0; i < num_files; i++) {
+        file_order[pos[group[i]]++] = i;
+    }
+    free(group);
+
+    int nth[MAX_NUMA_NODES] = {0};
+    for (unsigned i = 0; i < nshards; i++) {
+        Shard *s = &shards[i];
+        int n = s->node, j = nth[n]++, k = shards_on[n];
+        s->next = start[n] + (int)((long long)count[n] * j / k);
+        s->end = start[n] + (int)((long long)count[n] * (j + 1) / k);
+    }
+    return 0;
+}
+
+static int uring_run(FileList *list, const ReadOptions *opts) {
+    RIOVec *files = list->files;
+    // files listed from here on are claimed one at a time by whichever shard
+    // has room
+    int done = __atomic_load_n(&list->done, __ATOMIC_ACQUIRE);
+    int num_files = __atomic_load_n(&list->count, __ATOMIC_ACQUIRE);
+    file_list = list;
+    listed_next = num_files;
+
+    // contiguous blocks, one per worker, on the cpus we are allowed to use
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+    // with -n, workers are dealt out over the nodes that have allowed cpus
+    cpu_set_t *node_set = NULL;
+    int nodes[MAX_NUMA_NODES], nnodes = 0, cursor[MAX_NUMA_NODES];
+    if (numa_placement) {
+        node_set = calloc(MAX_NUMA_NODES, sizeof(cpu_set_t));
+        if (!node_set) {
+            perror("calloc");
+            return 1;
+        }
+        for (int n = 0; n < MAX_NUMA_NODES; n++) {
+            if (node_cpus(n, &node_set[n]) == 0) {
+                CPU_AND(&node_set[n], &node_set[n], &allowed);
+                if (CPU_COUNT(&node_set[n])) {
+                    cursor[n] = -1;
+                    nodes[nnodes++] = n;
+                }
+            }
+        }
+    }
+
+    nshards = opts->workers > 1 ? opts->workers : 1;
+    // every node gets a ring of its own, however few workers -w asked for
+    if (nshards < (unsigned)nnodes) {
+        nshards = nnodes;
+    }
+    if (done && (unsigned)num_files < nshards) {
+        nshards = num_files ? num_files : 1;
+    }
+    shards = calloc(nshards, sizeof(Shard));
+    ShardArgs *args = calloc(nshards, sizeof(ShardArgs));
+    if (!shards || !args) {
+        perror("calloc");
+        return 1;
+    }
+    stop_shards = 0;
+
+    // the first nnodes workers cover one node each, the rest go round again
+    int cpu = -1;
+    for (unsigned i = 0; i < nshards; i++) {
+        Shard *s = &shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->next = (int)((long long)num_files * i / nshards);
+        s->end = (int)((long long)num_files * (i + 1) / nshards);
+        s->node = -1;
+        if (nnodes) {
+            s->node = nodes[i % nnodes];
+            int *c = &cursor[s->node];
+            do {
+                *c = (*c + 1) % CPU_SETSIZE;
+            } while (!CPU_ISSET(*c, &node_set[s->node]));
+            s->cpu = *c;
+        } else {
+            do {
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            } while (!CPU_ISSET(cpu, &allowed));
+            s->cpu = cpu;
+        }
+        args[i] = (ShardArgs){ s, files, opts };
+    }
+    free(node_set);
+    if (nnodes && nshards > 1 && plan_nodes(files, num_files)) {
+        return 1;
+    }
+
+    int failed = 0;
+    // the calling thread's ring owns the shared io-wq, so its workers may run
+    // on any cpu the process may use
+    if (opts->share_wq && nshards > 1 && setup_shard(&shards[0], opts)) {
+        failed = 1;
+    } else if (nshards == 1) {
+        shards[0].cpu = -1;
+        failed = run_shard(&shards[0], files, opts);
+    } else {
+        unsigned started = 0;
+        for (; started < nshards; started++) {
+            int err = pthread_create(&shards[started].thread, NULL, shard_worker, &args[started]);
+            if (err) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                __atomic_store_n(&stop_shards, 1, __ATOMIC_RELAXED);
+                failed = 1;
+                break;
+            }
+        }
+        for (unsigned i = 0; i < started; i++) {
+            pthread_join(shards[i].thread, NULL);
+            failed |= shards[i].failed;
+        }
+    }
+    free(args);
+    free(file_order);
+    file_order = NULL;
+
+    int submitted = 0;
+    unsigned submits = 0, sq_wakeups = 0, steals = 0, inline_files = 0;
+    unsigned nowait_hits = 0, nowait_retries = 0;
+    size_t inline_bytes = 0;
+    for (unsigned i = 0; i < nshards; i++) {
+        Shard *s = &shards[i];
+        submitted += s->win.submitted;
+        submits += s->submits;
+        sq_wakeups += s->sq_wakeups;
+        steals += s->steals;
+        inline_files += s->win.inline_files;
+        inline_bytes += s->win.inline_bytes;
+        nowait_hits += s->win.nowait_hits;
+        nowait_retries += s->win.nowait_retries;
+        latency_merge(&read_latency, &s->lat);
+        free_window(&s->win);
+        pthread_mutex_destroy(&s->lock);
+    }
+    if (failed) {
+        return 1;
+    }
+    printf("submitted %d sqes\n", submitted);
+    if (opts->sqpoll) {
+        printf("sq thread needed %u wakeups over %u submits\n", sq_wakeups, submits);
+    }
+    if (nshards > 1) {
+        printf("%u workers, %u steals\n", nshards, steals);
+        if (nnodes) {
+            printf("workers spread over %d NUMA nodes\n", nnodes);
+        }
+    }
+    if (opts->hybrid) {
+        printf("%u files, %zu bytes read inline from the page cache\n", inline_files, inline_bytes);
+    }
+    if (opts->nowait) {
+        printf("%u reads served by RWF_NOWAIT, %u retried%s\n", nowait_hits, nowait_retries,
+            opts->retry_async ? " with IOSQE_ASYNC" : "");
+    }
+    return 0;
+}
+
+static void uring_release(void) {
+    unsigned fallbacks = 0;
+    for (unsigned i = 0; i < nshards; i++) {
+        Shard *s = &shards[i];
+        if (s->ring_ready) {
+            io_uring_queue_exit(&s->ring);
+        }
+        if (s->arena_size) {
+            fallbacks += s->arena.fallbacks;
+            free_arena(&s->arena);
+        }
+    }
+    if (fallbacks) {
+        printf("%u files did not fit in the registered arena\n", fallbacks);
+    }
+    free(shards);
+    shards = NULL;
+    nshards = 0;
+}
+
+const ReadEngine uring_engine = {
+    .name = "uring",
+    .probe = uring_probe,
+    .run = uring_run,
+    .release = uring_release,
+};